@@ -0,0 +1,608 @@
+//
+//  audio.cpp
+//  gemuboi
+//
+
+#include "audio.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// indexes into `APU::registers`
+static const U32 NR10 = 0x00;
+static const U32 NR30 = 0x0A;
+static const U32 NR32 = 0x0C;
+static const U32 NR43 = 0x12;
+static const U32 NR50 = 0x14;
+static const U32 NR51 = 0x15;
+static const U32 NR52 = 0x16;
+static const U32 WaveRAM = 0x20;
+
+// bits that always read back as 1, up to NR52
+static const U8 ReadMasks[NR52] = {
+    0x80, 0x3F, 0x00, 0xFF, 0xBF, // NR10-NR14
+    0xFF, 0x3F, 0x00, 0xFF, 0xBF, // NR20-NR24
+    0x7F, 0xFF, 0x9F, 0xFF, 0xBF, // NR30-NR34
+    0xFF, 0xFF, 0x00, 0x00, 0xBF, // NR40-NR44
+    0x00, 0x00,                   // NR50, NR51
+};
+
+// one bit per duty step, for 12.5%, 25%, 50% and 75%
+static const U8 DutyPatterns[4] = { 0x01, 0x81, 0x87, 0x7E };
+
+// how far each wave RAM sample is shifted down for each NR32 volume code
+static const U8 WaveVolumeShifts[4] = { 4, 0, 1, 2 };
+
+// all four channels at full volume, on a side with full master volume, fill an S16
+static const float OutputScale = 32767.0f / (Audio::ChannelCount * 15 * 8);
+
+// how quickly the high-pass filter follows the DC level, per output sample
+static const float HighPassRate = 1.0f / 1024.0f;
+
+
+/*
+ A windowed sinc for each sub-sample position, each summing to 1. The cutoff is a little
+ under the output's Nyquist frequency, and the window is Blackman.
+ */
+alignas(16) static float step_kernel[Audio::StepPhases][Audio::StepTaps];
+
+static struct StepKernelBuilder {
+    StepKernelBuilder() {
+        const double cutoff = 0.9;
+        const double pi = 3.14159265358979323846;
+        for(U32 phase = 0; phase < Audio::StepPhases; ++phase){
+            double offset = (double)phase / Audio::StepPhases;
+            double taps[Audio::StepTaps];
+            double sum = 0.0;
+            for(U32 tap = 0; tap < Audio::StepTaps; ++tap){
+                double x = tap - (Audio::StepTaps / 2.0 - 1.0) - offset;
+                double sinc = (x == 0.0 ? cutoff : sin(pi * cutoff * x) / (pi * x));
+                double u = (x + Audio::StepTaps / 2.0) / Audio::StepTaps;
+                double window = 0.42 - 0.5 * cos(2.0 * pi * u) + 0.08 * cos(4.0 * pi * u);
+                taps[tap] = sinc * window;
+                sum += taps[tap];
+            }
+            for(U32 tap = 0; tap < Audio::StepTaps; ++tap){
+                step_kernel[phase][tap] = (float)(taps[tap] / sum);
+            }
+        }
+    }
+} step_kernel_builder;
+
+
+void Audio::StepBuffer::clear(U32 sample_rate) {
+    assert(sample_rate <= MaxSampleRate);
+    samples_per_tick = ((U64)sample_rate << 32) / ClockRate;
+    frame_offset = 0;
+    integrator = 0.0f;
+    dc = 0.0f;
+    memset(deltas, 0, sizeof(deltas));
+}
+
+void Audio::StepBuffer::add_step(U32 tick, float delta) {
+    U64 position = frame_offset + (U64)tick * samples_per_tick;
+    U32 index = (U32)(position >> 32);
+    U32 phase = (U32)(position >> (32 - StepPhaseBits)) & (StepPhases - 1);
+    assert(index < SampleCapacity);
+
+    const float* kernel = step_kernel[phase];
+    float* out = &deltas[index];
+#if defined(__SSE2__)
+    __m128 scale = _mm_set1_ps(delta);
+    for(U32 tap = 0; tap < StepTaps; tap += 4){
+        __m128 step = _mm_mul_ps(_mm_load_ps(kernel + tap), scale);
+        _mm_storeu_ps(out + tap, _mm_add_ps(_mm_loadu_ps(out + tap), step));
+    }
+#else
+    for(U32 tap = 0; tap < StepTaps; ++tap){
+        out[tap] += kernel[tap] * delta;
+    }
+#endif
+}
+
+void Audio::StepBuffer::end_frame(U32 ticks) {
+    frame_offset += (U64)ticks * samples_per_tick;
+}
+
+void Audio::StepBuffer::read_samples(S16* out, U32 count, U32 stride) {
+    assert(count <= samples_available());
+
+    float sum = integrator;
+    float level = dc;
+    for(U32 i = 0; i < count; ++i){
+        sum += deltas[i];
+        float sample = sum - level;
+        level += sample * HighPassRate;
+        if(out){
+            if(sample > 32767.0f) sample = 32767.0f;
+            if(sample < -32768.0f) sample = -32768.0f;
+            out[i * stride] = (S16)sample;
+        }
+    }
+    integrator = sum;
+    dc = level;
+
+    remove_samples(count);
+}
+
+void Audio::StepBuffer::remove_samples(U32 count) {
+    const U32 total = SampleCapacity + StepTaps;
+    memmove(deltas, deltas + count, (total - count) * sizeof(float));
+    memset(deltas + total - count, 0, count * sizeof(float));
+    frame_offset -= (U64)count << 32;
+}
+
+
+void Audio::APU::reset(U32 sample_rate) {
+    memset(registers, 0, sizeof(registers));
+    memset(channels, 0, sizeof(channels));
+    sweep_frequency = 0;
+    sweep_timer = 0;
+    sweep_enabled = False;
+    lfsr = 0x7FFF;
+    sequencer_step = 0;
+    next_sequencer_tick = TicksPerSequencerStep;
+    frame_start_cycle = 0;
+    ticks_done = 0;
+    samples_dropped = 0;
+    this->sample_rate = sample_rate;
+    output_enabled = False;
+
+    for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+        update_period(channel_idx);
+        channels[channel_idx].next_edge = channels[channel_idx].period;
+    }
+    update_gains();
+    left.clear(sample_rate);
+    right.clear(sample_rate);
+}
+
+U8 Audio::APU::read_register(U16 address, U64 now) {
+    if(address - RegistersStart == NR52){
+        run_until(now); // a length counter may have run out since
+    }
+    return peek_register(address);
+}
+
+U8 Audio::APU::peek_register(U16 address) const {
+    U32 idx = address - RegistersStart;
+    if(idx >= WaveRAM)
+        return registers[idx];
+    if(idx > NR52)
+        return 0xFF; // unused
+
+    if(idx == NR52){
+        U8 status = (registers[NR52] & 0x80) | 0x70;
+        for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+            if(channels[channel_idx].enabled){
+                status |= (1 << channel_idx);
+            }
+        }
+        return status;
+    }
+
+    return registers[idx] | ReadMasks[idx];
+}
+
+void Audio::APU::store_register(U16 address, U8 value) {
+    U32 idx = address - RegistersStart;
+    if(idx == NR52){
+        registers[NR52] = value & 0x80;
+    } else if(idx < NR52 || idx >= WaveRAM){
+        registers[idx] = value;
+    }
+}
+
+void Audio::APU::write_register(U16 address, U8 value, U64 now) {
+    run_until(now);
+
+    U32 idx = address - RegistersStart;
+    if(idx >= WaveRAM){
+        registers[idx] = value;
+        return;
+    }
+    if(idx > NR52)
+        return; // unused
+
+    if(idx == NR52){
+        BOOL32 was_powered = powered();
+        registers[NR52] = value & 0x80; // the channel bits are read only
+        if(was_powered && !powered()){
+            // switching off clears every register
+            memset(registers, 0, NR52);
+            for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+                disable(channel_idx);
+            }
+            update_gains();
+        } else if(!was_powered && powered()){
+            sequencer_step = 0;
+        }
+        return;
+    }
+
+    if(!powered())
+        return; // only NR52 and wave RAM can be written while off
+    registers[idx] = value;
+
+    if(idx == NR50 || idx == NR51){
+        update_gains();
+        for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+            update_output(channel_idx, ticks_done);
+        }
+        return;
+    }
+
+    unsigned channel_idx = idx / 5;
+    Channel* channel = &channels[channel_idx];
+    switch(idx % 5){
+        case 0: // NR30's DAC switch (NR10 only matters when the sweep is clocked)
+            if(channel_idx == 2 && !dac_enabled(2)){
+                disable(2);
+            }
+            break;
+
+        case 1: // length, and the duty for the square channels
+            if(channel_idx == 2){
+                channel->length = 256 - value;
+            } else {
+                channel->length = 64 - (value & 0x3F);
+            }
+            break;
+
+        case 2: // envelope, or NR32's volume
+            if(!dac_enabled(channel_idx)){
+                disable(channel_idx);
+            } else {
+                update_output(channel_idx, ticks_done);
+            }
+            break;
+
+        case 3: // frequency low bits, or NR43's noise frequency
+            update_period(channel_idx);
+            break;
+
+        case 4:
+            update_period(channel_idx);
+            if(value & 0x80){
+                trigger(channel_idx);
+            }
+            break;
+    }
+}
+
+void Audio::APU::end_frame(U64 now) {
+    run_until(now);
+    finish_frame();
+}
+
+void Audio::APU::set_output_enabled(BOOL32 enabled, U64 now) {
+    run_until(now);
+    if(enabled == output_enabled)
+        return;
+
+    output_enabled = enabled;
+    if(enabled){
+        // nothing has been added to the buffers for a while, so start them from silence
+        left.clear(sample_rate);
+        right.clear(sample_rate);
+        for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+            channels[channel_idx].left = 0.0f;
+            channels[channel_idx].right = 0.0f;
+            update_output(channel_idx, ticks_done);
+        }
+    }
+}
+
+/*
+ Makes slightly more (`ratio` > 1) or fewer samples per emulated second than `sample_rate`,
+ so a frontend can keep its buffer level steady against the real output clock. Only call it
+ between frames, so every step in a frame is placed at the same rate.
+ */
+void Audio::APU::adjust_sample_rate(double ratio) {
+    assert(ticks_done == 0);
+    U64 samples_per_tick = (U64)((double)((U64)sample_rate << 32) * ratio / ClockRate);
+    left.samples_per_tick = samples_per_tick;
+    right.samples_per_tick = samples_per_tick;
+}
+
+U32 Audio::APU::read_samples(S16* out, U32 max_samples) {
+    U32 count = samples_available();
+    if(count > max_samples){
+        count = max_samples;
+    }
+    left.read_samples(out, count, 2);
+    right.read_samples(out + 1, count, 2);
+    return count;
+}
+
+BOOL32 Audio::APU::dac_enabled(unsigned channel_idx) {
+    if(channel_idx == 2)
+        return (registers[NR30] & 0x80) != 0;
+    return (channel_register(channel_idx, 2) & 0xF8) != 0; // volume or direction set
+}
+
+U16 Audio::APU::frequency(unsigned channel_idx) {
+    return channel_register(channel_idx, 3) | ((channel_register(channel_idx, 4) & 0x07) << 8);
+}
+
+// takes effect from the next waveform step
+void Audio::APU::update_period(unsigned channel_idx) {
+    Channel* channel = &channels[channel_idx];
+    switch(channel_idx){
+        case 0:
+        case 1:
+            channel->period = (2048 - frequency(channel_idx)) * 2;
+            break;
+        case 2:
+            channel->period = 2048 - frequency(channel_idx);
+            break;
+        case 3: {
+            U8 nr43 = registers[NR43];
+            U32 divisor = (nr43 & 0x07) ? (nr43 & 0x07) * 16 : 8;
+            channel->period = (divisor << (nr43 >> 4)) / CyclesPerTick;
+            break;
+        }
+    }
+}
+
+void Audio::APU::update_gains() {
+    U8 nr50 = registers[NR50];
+    U8 nr51 = registers[NR51];
+    float left_volume = (((nr50 >> 4) & 0x07) + 1) * OutputScale;
+    float right_volume = ((nr50 & 0x07) + 1) * OutputScale;
+    for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+        gains[channel_idx][0] = (nr51 & (0x10 << channel_idx)) ? left_volume : 0.0f;
+        gains[channel_idx][1] = (nr51 & (0x01 << channel_idx)) ? right_volume : 0.0f;
+    }
+}
+
+// works out what the channel is outputting now, and adds a step on each side where it changed
+void Audio::APU::update_output(unsigned channel_idx, U32 tick) {
+    if(!output_enabled)
+        return;
+
+    Channel* channel = &channels[channel_idx];
+
+    U8 amplitude = 0;
+    if(channel->enabled){
+        switch(channel_idx){
+            case 0:
+            case 1: {
+                U8 duty = DutyPatterns[channel_register(channel_idx, 1) >> 6];
+                amplitude = ((duty >> channel->position) & 1) ? channel->volume : 0;
+                break;
+            }
+            case 2: {
+                U8 byte = registers[WaveRAM + channel->position / 2];
+                U8 sample = (channel->position & 1) ? (byte & 0x0F) : (byte >> 4);
+                amplitude = sample >> WaveVolumeShifts[(registers[NR32] >> 5) & 0x03];
+                break;
+            }
+            case 3:
+                amplitude = (lfsr & 1) ? 0 : channel->volume;
+                break;
+        }
+    }
+
+    float left_level = amplitude * gains[channel_idx][0];
+    float right_level = amplitude * gains[channel_idx][1];
+    if(left_level != channel->left){
+        left.add_step(tick, left_level - channel->left);
+        channel->left = left_level;
+    }
+    if(right_level != channel->right){
+        right.add_step(tick, right_level - channel->right);
+        channel->right = right_level;
+    }
+}
+
+void Audio::APU::trigger(unsigned channel_idx) {
+    Channel* channel = &channels[channel_idx];
+    channel->enabled = dac_enabled(channel_idx);
+    if(channel->length == 0){
+        channel->length = (channel_idx == 2 ? 256 : 64);
+    }
+    channel->next_edge = ticks_done + channel->period;
+
+    U8 envelope = channel_register(channel_idx, 2);
+    channel->volume = envelope >> 4;
+    channel->envelope_timer = envelope & 0x07;
+
+    if(channel_idx == 0){
+        U8 nr10 = registers[NR10];
+        U8 sweep_period = (nr10 >> 4) & 0x07;
+        sweep_frequency = frequency(0);
+        sweep_timer = sweep_period ? sweep_period : 8;
+        sweep_enabled = (sweep_period != 0 || (nr10 & 0x07) != 0);
+        if((nr10 & 0x07) && sweep_next_frequency() > 2047){
+            channel->enabled = False;
+        }
+    } else if(channel_idx == 2){
+        channel->position = 0;
+    } else if(channel_idx == 3){
+        lfsr = 0x7FFF;
+    }
+
+    update_output(channel_idx, ticks_done);
+}
+
+void Audio::APU::disable(unsigned channel_idx) {
+    channels[channel_idx].enabled = False;
+    update_output(channel_idx, ticks_done);
+}
+
+U16 Audio::APU::sweep_next_frequency() {
+    U8 nr10 = registers[NR10];
+    U16 delta = sweep_frequency >> (nr10 & 0x07);
+    return (nr10 & 0x08) ? (sweep_frequency - delta) : (sweep_frequency + delta);
+}
+
+void Audio::APU::clock_lengths() {
+    for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+        Channel* channel = &channels[channel_idx];
+        BOOL32 length_enabled = (channel_register(channel_idx, 4) & 0x40) != 0;
+        if(length_enabled && channel->length > 0){
+            channel->length -= 1;
+            if(channel->length == 0 && channel->enabled){
+                disable(channel_idx);
+            }
+        }
+    }
+}
+
+void Audio::APU::clock_sweep() {
+    if(!sweep_enabled)
+        return;
+    if(sweep_timer > 1){
+        sweep_timer -= 1;
+        return;
+    }
+
+    U8 nr10 = registers[NR10];
+    U8 sweep_period = (nr10 >> 4) & 0x07;
+    sweep_timer = sweep_period ? sweep_period : 8;
+    if(sweep_period == 0)
+        return;
+
+    U16 next_frequency = sweep_next_frequency();
+    if(next_frequency > 2047){
+        disable(0);
+        return;
+    }
+    if(nr10 & 0x07){
+        sweep_frequency = next_frequency;
+        channel_register(0, 3) = next_frequency & 0xFF;
+        channel_register(0, 4) = (channel_register(0, 4) & ~0x07) | (next_frequency >> 8);
+        update_period(0);
+
+        // checked again with the new frequency, but not written back
+        if(sweep_next_frequency() > 2047){
+            disable(0);
+        }
+    }
+}
+
+void Audio::APU::clock_envelopes() {
+    const unsigned enveloped_channels[3] = { 0, 1, 3 };
+    for(unsigned i = 0; i < 3; ++i){
+        unsigned channel_idx = enveloped_channels[i];
+        Channel* channel = &channels[channel_idx];
+        U8 envelope = channel_register(channel_idx, 2);
+        U8 envelope_period = envelope & 0x07;
+        if(!channel->enabled || envelope_period == 0)
+            continue;
+        if(channel->envelope_timer > 1){
+            channel->envelope_timer -= 1;
+            continue;
+        }
+
+        channel->envelope_timer = envelope_period;
+        if((envelope & 0x08) && channel->volume < 15){
+            channel->volume += 1;
+            update_output(channel_idx, ticks_done);
+        } else if(!(envelope & 0x08) && channel->volume > 0){
+            channel->volume -= 1;
+            update_output(channel_idx, ticks_done);
+        }
+    }
+}
+
+/*
+ Moves the channel's waveform along up to `end_tick`. If nothing can be heard from it, the
+ steps are skipped in one go (the noise channel's shift register is left where it was).
+ */
+void Audio::APU::run_channel(unsigned channel_idx, U32 end_tick) {
+    Channel* channel = &channels[channel_idx];
+    if(channel->next_edge >= end_tick)
+        return;
+
+    U8 position_mask = (channel_idx == 2 ? 31 : 7);
+    BOOL32 silent = (!output_enabled || !channel->enabled ||
+                     (gains[channel_idx][0] == 0.0f && gains[channel_idx][1] == 0.0f) ||
+                     (channel_idx == 2 ? (registers[NR32] & 0x60) == 0 : channel->volume == 0));
+    if(silent){
+        U32 edges = (end_tick - channel->next_edge + channel->period - 1) / channel->period;
+        channel->next_edge += edges * channel->period;
+        channel->position = (channel->position + edges) & position_mask;
+        return;
+    }
+
+    BOOL32 short_lfsr = (registers[NR43] & 0x08) != 0;
+    while(channel->next_edge < end_tick){
+        if(channel_idx == 3){
+            U16 bit = (lfsr ^ (lfsr >> 1)) & 1;
+            lfsr = (lfsr >> 1) | (bit << 14);
+            if(short_lfsr){
+                lfsr = (lfsr & ~0x40) | (bit << 6);
+            }
+        } else {
+            channel->position = (channel->position + 1) & position_mask;
+        }
+        update_output(channel_idx, channel->next_edge);
+        channel->next_edge += channel->period;
+    }
+}
+
+void Audio::APU::run(U32 end_tick) {
+    while(ticks_done < end_tick){
+        U32 until = (next_sequencer_tick < end_tick ? next_sequencer_tick : end_tick);
+        for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+            run_channel(channel_idx, until);
+        }
+        ticks_done = until;
+
+        if(ticks_done == next_sequencer_tick){
+            next_sequencer_tick += TicksPerSequencerStep;
+            if(powered()){
+                if((sequencer_step & 1) == 0){
+                    clock_lengths();
+                }
+                if(sequencer_step == 2 || sequencer_step == 6){
+                    clock_sweep();
+                }
+                if(sequencer_step == 7){
+                    clock_envelopes();
+                }
+            }
+            sequencer_step = (sequencer_step + 1) & 7;
+        }
+    }
+}
+
+void Audio::APU::run_until(U64 now) {
+    U64 end_tick = (now - frame_start_cycle) / CyclesPerTick;
+    while(end_tick > MaxFrameTicks){
+        run(MaxFrameTicks);
+        end_tick -= MaxFrameTicks;
+        finish_frame();
+    }
+    run((U32)end_tick);
+}
+
+void Audio::APU::finish_frame() {
+    if(output_enabled){
+        left.end_frame(ticks_done);
+        right.end_frame(ticks_done);
+    }
+
+    for(unsigned channel_idx = 0; channel_idx < ChannelCount; ++channel_idx){
+        channels[channel_idx].next_edge -= ticks_done;
+    }
+    next_sequencer_tick -= ticks_done;
+    frame_start_cycle += (U64)ticks_done * CyclesPerTick;
+    ticks_done = 0;
+
+    // nobody has been reading the samples, so make room for the next frame
+    const U32 sample_limit = SampleCapacity / 2;
+    U32 available = samples_available();
+    if(available > sample_limit){
+        U32 excess = available - sample_limit;
+        left.read_samples(NULL, excess, 0);
+        right.read_samples(NULL, excess, 0);
+        samples_dropped += excess;
+    }
+}
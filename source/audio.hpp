@@ -0,0 +1,153 @@
+//
+//  audio.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include "types.hpp"
+
+/*
+ The APU has four channels:
+
+    1 - square wave, with a frequency sweep and a volume envelope (NR10-NR14)
+    2 - square wave, with a volume envelope (NR21-NR24)
+    3 - 32 4-bit samples played from wave RAM (NR30-NR34, FF30-FF3F)
+    4 - noise from a shift register, with a volume envelope (NR41-NR44)
+
+ Each channel has the same 5 register layout (NRx0-NRx4), starting at NR10, so channel 2's
+ NR20 and channel 4's NR40 exist but do nothing. NR50 is the master volume for each side,
+ NR51 chooses which side(s) each channel comes out of, and NR52 switches the APU on/off
+ and reports which channels are on.
+
+ A 512Hz frame sequencer clocks the length counters (256Hz), the sweep (128Hz) and the
+ envelopes (64Hz).
+ */
+namespace Audio {
+    const U16 RegistersStart = 0xFF10; // NR10
+    const U16 RegistersEnd = 0xFF3F; // the end of wave RAM
+    const U32 RegisterCount = RegistersEnd - RegistersStart + 1;
+    const U32 ChannelCount = 4;
+
+    // everything in the APU happens on even CPU cycles
+    const U32 CyclesPerTick = 2;
+    const U32 ClockRate = 4194304 / CyclesPerTick; //Hz
+
+    const U32 TicksPerSequencerStep = ClockRate / 512;
+
+    const U32 StepTaps = 16;
+    const U32 StepPhaseBits = 5;
+    const U32 StepPhases = 1 << StepPhaseBits;
+
+    const U32 DefaultSampleRate = 48000;
+    const U32 MaxSampleRate = 96000;
+    const U32 SampleCapacity = 8192;
+    // frames longer than this are split up, so one frame can never fill `StepBuffer`
+    const U32 MaxFrameTicks = 65536;
+
+    /*
+     Each channel's output is a series of steps, at times measured in APU ticks (2MHz). Instead
+     of generating the waveform at 2MHz and filtering it down to the output rate, each step is
+     added straight into a buffer at the output rate as a band-limited step (BLEP): a low-pass
+     filtered impulse, taken from a windowed sinc table with `StepPhases` sub-sample
+     positions, which gets integrated when the samples are read out.
+
+     The cost is `StepTaps` multiply-adds per step, plus a little per output sample. Nothing is
+     done for the ticks in between, so a silent or unchanging channel costs nothing.
+     */
+    struct StepBuffer {
+        U64 samples_per_tick; // 32.32 fixed point
+        U64 frame_offset; // where tick 0 of the current frame lands, 32.32 fixed point
+        float integrator;
+        float dc; // what the high-pass filter is removing
+        float deltas[SampleCapacity + StepTaps];
+
+        void clear(U32 sample_rate);
+        void add_step(U32 tick, float delta);
+        void end_frame(U32 ticks);
+        U32 samples_available() const { return (U32)(frame_offset >> 32); }
+        // writes `count` samples, `stride` apart, and removes them
+        void read_samples(S16* out, U32 count, U32 stride);
+        void remove_samples(U32 count);
+    };
+
+    struct Channel {
+        BOOL32 enabled; // NR52 bits 0-3
+        U32 length; // frame sequencer steps until the length counter disables the channel
+        U8 volume; // from the envelope, 0-15
+        U8 envelope_timer;
+        U32 period; // ticks between waveform steps
+        U32 next_edge; // tick within the frame of the next waveform step
+        U8 position; // duty step (0-7) or wave RAM sample (0-31)
+        float left; // last output on each side, after NR50/NR51
+        float right;
+    };
+
+    /*
+     Nothing is clocked per instruction. Every register access comes with the cycle it happened
+     on, and the APU only catches up to that cycle (from `ticks_done`) when a register is
+     written, when NR52's status bits are read, or when the samples are drained with
+     `end_frame`/`read_samples`.
+
+     Until `set_output_enabled` turns the samples on, catching up only runs the frame
+     sequencer (so lengths, sweep and envelopes still switch channels off on time) and skips
+     over the waveforms, so a headless run that never listens only pays for the bookkeeping.
+     */
+    struct APU {
+        U8 registers[RegisterCount];
+        Channel channels[ChannelCount];
+
+        U16 sweep_frequency; // channel 1's shadow frequency
+        U8 sweep_timer;
+        BOOL32 sweep_enabled;
+        U16 lfsr; // channel 4's shift register
+
+        U8 sequencer_step;
+        U32 next_sequencer_tick;
+
+        U64 frame_start_cycle;
+        U32 ticks_done; // since `frame_start_cycle`
+        U32 samples_dropped; // because nothing read them out in time
+        U32 sample_rate;
+        BOOL32 output_enabled;
+
+        float gains[ChannelCount][2]; // left, right, from NR50 and NR51
+        StepBuffer left;
+        StepBuffer right;
+
+        void reset(U32 sample_rate);
+        U8 read_register(U16 address, U64 now);
+        void write_register(U16 address, U8 value, U64 now);
+        // just the registers, with nothing caught up or synthesised (see `HeadlessConfig`)
+        U8 peek_register(U16 address) const;
+        void store_register(U16 address, U8 value);
+        void end_frame(U64 now);
+        void set_output_enabled(BOOL32 enabled, U64 now);
+        void adjust_sample_rate(double ratio);
+
+        U32 samples_available() const { return left.samples_available(); }
+        // interleaved left/right, returns how many sample pairs were written
+        U32 read_samples(S16* out, U32 max_samples);
+
+    private:
+        U8& channel_register(unsigned channel_idx, unsigned register_idx) {
+            return registers[channel_idx * 5 + register_idx];
+        }
+        BOOL32 powered() const { return (registers[0x16] & 0x80) != 0; } // NR52 bit 7
+        BOOL32 dac_enabled(unsigned channel_idx);
+        U16 frequency(unsigned channel_idx);
+        void update_period(unsigned channel_idx);
+        void update_gains();
+        void update_output(unsigned channel_idx, U32 tick);
+        void trigger(unsigned channel_idx);
+        void disable(unsigned channel_idx);
+        U16 sweep_next_frequency();
+        void clock_lengths();
+        void clock_sweep();
+        void clock_envelopes();
+        void run_channel(unsigned channel_idx, U32 end_tick);
+        void run(U32 end_tick);
+        void run_until(U64 now);
+        void finish_frame();
+    };
+} //namespace Audio
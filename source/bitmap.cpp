@@ -8,6 +8,7 @@
 
 #include "bitmap.hpp"
 #include <cstring>
+#include <cstdint>
 
 Bitmap::Bitmap(U16 w, U16 h) :
     width(w),
@@ -15,30 +16,51 @@ Bitmap::Bitmap(U16 w, U16 h) :
 {
     assert(width > 0);
     assert(height > 0);
-    pixels = new U8[width * height];
+
+    // round each row up to the alignment, and over-allocate so the first row can be aligned too
+    stride = (width + RowAlignment - 1) & ~(RowAlignment - 1);
+    allocation = new U8[stride * height + RowAlignment - 1];
+    uintptr_t misalignment = (uintptr_t)allocation & (RowAlignment - 1);
+    pixels = allocation + (misalignment ? RowAlignment - misalignment : 0);
+}
+
+Bitmap::Bitmap(U16 w, U16 h, U8* external_pixels, U32 external_stride) :
+    width(w),
+    height(h),
+    stride(external_stride),
+    pixels(external_pixels),
+    allocation(NULL)
+{
+    assert(width > 0);
+    assert(height > 0);
+    assert(stride >= width);
+    assert(pixels);
 }
 
 Bitmap::~Bitmap() {
-    if(pixels)
-        delete[] pixels;
+    if(allocation)
+        delete[] allocation;
 }
 
 void Bitmap::clear(U8 color){
-    fillRect(color, 0, 0, width, height);
+    if(stride == width){
+        memset(pixels, color, stride * height);
+    } else {
+        fillRect(color, 0, 0, width, height);
+    }
 }
 
 void Bitmap::fillRect(U8 color, U16 rx, U16 ry, U16 rwidth, U16 rheight) {
     if(rwidth == 0 || rheight == 0)
         return;
 
-    U16 rmaxx = rx + rwidth;
-    U16 rmaxy = ry + rheight;
+    assert(rx + rwidth <= width);
+    assert(ry + rheight <= height);
 
-    for(unsigned x = rx; x < rmaxx; ++x){
-        for(unsigned y = ry; y < rmaxy; ++y){
-            U8* pixel = pixelPtr(x, y);
-            *pixel = color;
-        }
+    U8* row = pixelPtr(rx, ry);
+    for(unsigned y = 0; y < rheight; ++y){
+        memset(row, color, rwidth);
+        row += stride;
     }
 }
 
@@ -53,11 +75,37 @@ U8 Bitmap::getPixel(U16 x, U16 y) {
 }
 
 void Bitmap::copyFromBitmap(Bitmap *other, U16 srcX, U16 srcY, U16 dstX, U16 dstY, U16 width, U16 height){
-    for(U16 x = 0; x < width; ++x){
+    if(width == 0 || height == 0)
+        return;
+
+    assert(srcX + width <= other->width);
+    assert(srcY + height <= other->height);
+    assert(dstX + width <= this->width);
+    assert(dstY + height <= this->height);
+
+    const U8* src_row = other->pixelPtr(srcX, srcY);
+    U8* dst_row = pixelPtr(dstX, dstY);
+
+    if(other == this && srcY < dstY){
+        // overlapping and moving down, so go bottom-up to avoid reading rows already overwritten
+        src_row += (height - 1) * other->stride;
+        dst_row += (height - 1) * stride;
         for(U16 y = 0; y < height; ++y){
-            U8* srcPixel = other->pixelPtr(srcX + x, srcY + y);
-            U8* dstPixel = pixelPtr(dstX + x, dstY + y);
-            *dstPixel = *srcPixel;
+            memmove(dst_row, src_row, width);
+            src_row -= other->stride;
+            dst_row -= stride;
+        }
+    } else if(other == this){
+        for(U16 y = 0; y < height; ++y){
+            memmove(dst_row, src_row, width);
+            src_row += other->stride;
+            dst_row += stride;
+        }
+    } else {
+        for(U16 y = 0; y < height; ++y){
+            memcpy(dst_row, src_row, width);
+            src_row += other->stride;
+            dst_row += stride;
         }
     }
-}
\ No newline at end of file
+}
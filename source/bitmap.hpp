@@ -3,12 +3,24 @@
 #include "types.hpp"
 #include <cassert>
 
+/*
+ An 8-bit-per-pixel image, stored row by row.
+
+ Rows are `stride` bytes apart, which can be more than `width`. Bitmaps that allocate their
+ own pixels align every row to `RowAlignment` bytes. Bitmaps can also wrap memory owned by
+ someone else (a locked texture, shared memory, a frame buffer, etc.) in which case the
+ memory is left alone when the bitmap is destroyed.
+ */
 struct Bitmap {
+    static const U32 RowAlignment = 64;
+
     U16 width;
     U16 height;
+    U32 stride; // in bytes
     U8* pixels;
 
     Bitmap(U16 width, U16 height);
+    Bitmap(U16 width, U16 height, U8* pixels, U32 stride);
     ~Bitmap();
     void clear(U8 color);
     void fillRect(U8 color, U16 x, U16 y, U16 width, U16 height);
@@ -19,6 +31,12 @@ struct Bitmap {
     U8* pixelPtr(U16 x, U16 y){
         assert(x < width);
         assert(y < height);
-        return pixels + (y * width) + x;
+        return pixels + (y * stride) + x;
     }
-};
\ No newline at end of file
+
+private:
+    U8* allocation; // NULL if the pixels are owned by someone else
+
+    Bitmap(const Bitmap&);
+    Bitmap& operator=(const Bitmap&);
+};
@@ -16,6 +16,9 @@ namespace Cart {
     const size_t MaxSize = 8 * 1024 * 1024; //8MiB
     const size_t TitleSize = 17; //16 bytes + null terminator
 
+    // what traces and the profiler call the bootstrap ROM, where they record a ROM bank
+    const U8 BootstrapBank = 0xFF;
+
     struct Header {
         // 0000-0099
         // arbitrary instructions (interrupt handlers)
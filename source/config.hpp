@@ -0,0 +1,41 @@
+//
+//  config.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include "types.hpp"
+
+/*
+ Compile-time switches for the core. `EmulatorT` (and `Video::GPU::step`) is instantiated
+ once per config, and every check on these is a plain `if` on a constant, so a config that
+ switches something off doesn't test for it at run time either.
+ */
+
+// the SDL frontend: everything on
+struct DesktopConfig {
+    static const BOOL32 AudioSynthesis = True; // otherwise the APU only stores its registers
+    static const BOOL32 DebugViews = True; // keep track of VRAM changes for the debug panel
+    static const BOOL32 RenderThread = True; // frames may be rendered on a worker thread
+    static const BOOL32 Breakpoints = True; // `Debugger::Debugger` breakpoints and watchpoints
+    static const BOOL32 Tracing = True; // instructions go into `trace`, when it's set
+    static const BOOL32 Profiling = True; // cycles are attributed by `profiler`, when it's set
+    static const BOOL32 Counters = True; // `instructions` and `counters`, see `emulator_counters`
+    static const BOOL32 Asserts = True; // `EMU_ASSERT`, as long as NDEBUG isn't defined
+};
+
+// batch runs (e.g. training agents) that only want the screen and the memory
+struct HeadlessConfig {
+    static const BOOL32 AudioSynthesis = False;
+    static const BOOL32 DebugViews = False;
+    static const BOOL32 RenderThread = False;
+    static const BOOL32 Breakpoints = False;
+    static const BOOL32 Tracing = False;
+    static const BOOL32 Profiling = False;
+    static const BOOL32 Counters = True; // cheap, and batch runs are what most need watching
+    static const BOOL32 Asserts = False;
+};
+
+// for code templated on `class Config`
+#define EMU_ASSERT(condition) do { if(Config::Asserts){ assert(condition); } } while(0)
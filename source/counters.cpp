@@ -0,0 +1,24 @@
+//
+//  counters.cpp
+//  gemuboi
+//
+
+#include "counters.hpp"
+
+void Counters::write_json(FILE* f, U32 instance, const Snapshot* snapshot) {
+    fprintf(f,
+            "{\"instance\":%u,\"instructions\":%llu,\"cycles\":%llu,\"frames\":%llu,"
+            "\"halted_cycles\":%llu,\"slow_reads\":%llu,\"slow_writes\":%llu,"
+            "\"cpu_ns\":%llu,\"gpu_ns\":%llu,\"render_thread_ns\":%llu,\"frontend_ns\":%llu}\n",
+            instance,
+            (unsigned long long)snapshot->instructions,
+            (unsigned long long)snapshot->cycles,
+            (unsigned long long)snapshot->frames,
+            (unsigned long long)snapshot->halted_cycles,
+            (unsigned long long)snapshot->slow_reads,
+            (unsigned long long)snapshot->slow_writes,
+            (unsigned long long)snapshot->cpu_ns,
+            (unsigned long long)snapshot->gpu_ns,
+            (unsigned long long)snapshot->render_thread_ns,
+            (unsigned long long)snapshot->frontend_ns);
+}
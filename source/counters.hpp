@@ -0,0 +1,50 @@
+//
+//  counters.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <stdio.h>
+#include <chrono>
+#include "types.hpp"
+
+namespace Counters {
+    // host time, for measuring intervals only
+    inline U64 now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /*
+     The tallies an emulator keeps as it runs (except `EmulatorT::instructions`, which is
+     counted on every instruction so lives with the hot state). Host time is only read around
+     whole runs and around rendering, never per instruction.
+     */
+    struct Counters {
+        U64 halted_cycles; // spent halted, waiting for an interrupt
+        U64 slow_reads; // reads and fetches that missed the page table
+        U64 slow_writes; // writes that missed the page table
+        U64 run_ns; // host time in `emulator_run_until_frame`, rendering included
+        U64 frontend_ns; // added by the frontend, for its own work between runs
+    };
+
+    /*
+     Everything about one emulator, as of one moment, from `emulator_counters`. All of it
+     counts from `emulator_init`, so rates come from the difference between two snapshots.
+     */
+    struct Snapshot {
+        U64 instructions; // not counting interrupt dispatches or halted steps
+        U64 cycles;
+        U64 frames;
+        U64 halted_cycles;
+        U64 slow_reads;
+        U64 slow_writes;
+        U64 cpu_ns; // running the core, less `gpu_ns`
+        U64 gpu_ns; // rendering on the emulation thread, including waiting for the render thread
+        U64 render_thread_ns; // rendering on the render thread, in parallel with the rest
+        U64 frontend_ns;
+    };
+
+    // one JSON object on one line, e.g. {"instance":0,"instructions":123,...}
+    void write_json(FILE* f, U32 instance, const Snapshot* snapshot);
+} //namespace Counters
@@ -0,0 +1,112 @@
+//
+//  debugger.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <string.h>
+#include "types.hpp"
+
+namespace Debugger {
+    const U32 AddressCount = 0x10000;
+    const U32 PageCount = 0x100;
+    const U32 NoAddress = ~0U;
+
+    /*
+     One of the opcodes the CPU doesn't have. An instruction fetch that should stop returns
+     this instead of the real opcode, and the instruction handler for it backs PC up and ends
+     the step without doing anything.
+     */
+    const U8 TrapOpcode = 0xD3;
+
+    enum WatchKind {
+        Watch_Read = 0x01,
+        Watch_Write = 0x02,
+    };
+
+    // one bit per address in the 64K address space
+    struct AddressBitmap {
+        U64 bits[AddressCount / 64];
+
+        BOOL32 test(U16 address) const { return (bits[address >> 6] >> (address & 63)) & 1; }
+
+        // returns whether the bit changed
+        BOOL32 set(U16 address, BOOL32 enabled) {
+            U64 mask = 1ULL << (address & 63);
+            U64 old_bits = bits[address >> 6];
+            bits[address >> 6] = (enabled ? old_bits | mask : old_bits & ~mask);
+            return bits[address >> 6] != old_bits;
+        }
+    };
+
+    /*
+     Nothing here is checked per instruction. Each page with a breakpoint or a read
+     watchpoint in it is left out of the page table for reads, and each page with a write
+     watchpoint for writes, so only accesses to those pages reach the slow path where the
+     bitmaps are tested. With nothing set the page table is exactly as it would be without
+     the debugger.
+
+     Breakpoints stop before the instruction runs. Watchpoints stop after the instruction
+     that made the access: `break_pending` is set and the whole page table is swapped out,
+     so the next fetch is slow too and traps. Read watchpoints see operands, but not opcode
+     fetches, which are what breakpoints are for.
+     */
+    struct Debugger {
+        AddressBitmap breakpoints;
+        AddressBitmap read_watchpoints;
+        AddressBitmap write_watchpoints;
+        U16 slow_reads[PageCount]; // breakpoints and read watchpoints in each page
+        U16 slow_writes[PageCount]; // write watchpoints in each page
+
+        BOOL32 break_pending; // a watchpoint was hit, trap on the next fetch
+        BOOL32 trapped; // the fetched `TrapOpcode` is a trap, not the real opcode
+        BOOL32 stopped; // set by the trap, cleared by `emulator_resume`
+        U32 resume_address; // the breakpoint being resumed from, which mustn't trap again
+        U32 hit_address; // the breakpoint or watched address that stopped it
+        U8 hit_kind; // 0 for a breakpoint, otherwise a `WatchKind`
+
+        void reset() {
+            memset(this, 0, sizeof(*this));
+            resume_address = NoAddress;
+            hit_address = NoAddress;
+        }
+
+        BOOL32 any_slow_reads(U8 page) const { return slow_reads[page] != 0; }
+        BOOL32 any_slow_writes(U8 page) const { return slow_writes[page] != 0; }
+
+        void set_breakpoint(U16 address, BOOL32 enabled) {
+            if(breakpoints.set(address, enabled)){
+                slow_reads[address >> 8] += (enabled ? 1 : -1);
+            }
+            resume_address = NoAddress;
+        }
+
+        void set_watchpoint(U16 address, U8 kinds, BOOL32 enabled) {
+            if((kinds & Watch_Read) && read_watchpoints.set(address, enabled)){
+                slow_reads[address >> 8] += (enabled ? 1 : -1);
+            }
+            if((kinds & Watch_Write) && write_watchpoints.set(address, enabled)){
+                slow_writes[address >> 8] += (enabled ? 1 : -1);
+            }
+        }
+
+        // called for every slow instruction fetch
+        BOOL32 should_trap(U16 address) {
+            BOOL32 resuming = (address == resume_address);
+            resume_address = NoAddress;
+            if(break_pending)
+                return True;
+            if(!resuming && breakpoints.test(address)){
+                hit_address = address;
+                hit_kind = 0;
+                return True;
+            }
+            return False;
+        }
+
+        BOOL32 is_watched(U16 address, WatchKind kind) const {
+            return (kind == Watch_Read ? read_watchpoints : write_watchpoints).test(address);
+        }
+    };
+} //namespace Debugger
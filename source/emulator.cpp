@@ -7,6 +7,7 @@
 //
 
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstring>
 
@@ -245,7 +246,8 @@ void rl(U8* in_out_value, CPU::Registers* registers) {
     registers->set_carry_flag(old_high_bit);
 }
 
-U8 emu_standard_operand_read(Emulator* emu, U8 opcode) {
+template<class Config>
+U8 emu_standard_operand_read(EmulatorT<Config>* emu, U8 opcode) {
     CPU::Registers* r = &emu->registers;
 
     U8 lower_nibble = (opcode & 0x0F);
@@ -259,12 +261,13 @@ U8 emu_standard_operand_read(Emulator* emu, U8 opcode) {
         case 0x06: case 0x0E: return emu->mem_read(r->hl);
         case 0x07: case 0x0F: return r->a;
         default:
-            assert(0); //should never get here
+            EMU_ASSERT(0); //should never get here
             return 0;
     }
 }
 
-void emu_standard_operand_write(Emulator* emu, U8 opcode, U8 value) {
+template<class Config>
+void emu_standard_operand_write(EmulatorT<Config>* emu, U8 opcode, U8 value) {
     CPU::Registers* r = &emu->registers;
 
     U8 lower_nibble = (opcode & 0x0F);
@@ -278,11 +281,12 @@ void emu_standard_operand_write(Emulator* emu, U8 opcode, U8 value) {
         case 0x06: case 0x0E: return emu->mem_write(r->hl, value); break;
         case 0x07: case 0x0F: r->a = value; break;
         default:
-            assert(0); //should never get here
+            EMU_ASSERT(0); //should never get here
     }
 }
 
-void emu_cb_instruction(Emulator* emu, U8 cb_instr) {
+template<class Config>
+void emu_cb_instruction(EmulatorT<Config>* emu, U8 cb_instr) {
     CPU::Registers* r = &emu->registers;
     U8 operand = emu_standard_operand_read(emu, cb_instr);
 
@@ -650,20 +654,71 @@ void emu_cb_instruction(Emulator* emu, U8 cb_instr) {
     emu_standard_operand_write(emu, cb_instr, operand);
 }
 
+// which ROM bank `address` is in: the bootstrap ROM while it's mapped, otherwise 0 or 1 (standing in for whichever is switched in, as there's no bank switching yet)
+template<class Config>
+U8 emu_rom_bank(EmulatorT<Config>* emu, U16 address) {
+    if(address <= 0x00FF && emu->io_register(HardwareRegisters::BootstrapROM) == BootstrapRom_Enabled){
+        return Cart::BootstrapBank;
+    }
+    return (address >= 0x4000 && address <= 0x7FFF ? 1 : 0);
+}
+
+// attributes an instruction that just ran, and follows it if it called or returned
+template<class Config>
+void emu_profile_instruction(EmulatorT<Config>* emu, U16 pc, U8 opcode, U8 length, U8 cycles) {
+    Profiler::Profiler* profiler = emu->profiler;
+    profiler->add_cycles(pc, emu_rom_bank(emu, pc), cycles);
+
+    U16 next_pc = pc + length;
+    U16 new_pc = emu->registers.pc;
+    switch(Profiler::flow(opcode)){
+        case Profiler::Flow_ConditionalCall:
+            if(new_pc == next_pc)
+                break;
+            // fall through
+        case Profiler::Flow_Call:
+            profiler->call(new_pc, emu_rom_bank(emu, new_pc), next_pc, False);
+            break;
+
+        case Profiler::Flow_ConditionalReturn:
+            if(new_pc == next_pc)
+                break;
+            // fall through
+        case Profiler::Flow_Return:
+            profiler->ret(new_pc);
+            break;
+
+        case Profiler::Flow_None:
+            break;
+    }
+}
+
 // returns number of cycles used
-U8 emu_apply_next_instruction(Emulator* emu) {
+template<class Config>
+U8 emu_apply_next_instruction(EmulatorT<Config>* emu) {
     CPU::Registers* const r = &emu->registers;
+    const U16 instr_pc = r->pc;
 
-    const U8 instr[3] = {
-        emu->mem_read(r->pc),
-        emu->mem_read(r->pc + 1),
-        emu->mem_read(r->pc + 2)
-    };
-    const U8 opcode = instr[0];
+    const U8 opcode = emu->mem_fetch(r->pc);
+    const CPU::OpcodeDesc& opcode_description = CPU::Opcodes[opcode];
+
+    // only the operands this instruction has, as reading any further could trip a read watchpoint
+    U8 instr[3] = { opcode, 0, 0 };
+    switch(opcode_description.byte_length){
+        case 3:
+            instr[2] = emu->mem_read(r->pc + 2);
+            // fall through
+        case 2:
+            instr[1] = emu->mem_read(r->pc + 1);
+            break;
+    }
     const U8 direct_u8 = instr[1];
     const S8 direct_s8 = (S8)direct_u8;
     const U16 direct_u16 = *((U16*)&instr[1]);
-    const CPU::OpcodeDesc& opcode_description = CPU::Opcodes[opcode];
+
+    if(Config::Tracing && emu->trace && !(Config::Breakpoints && emu->debugger.trapped)){
+        emu->trace->append(r, emu_rom_bank(emu, r->pc), instr, emu->scheduler.cycles);
+    }
 
     U8 additional_cycles = 0; //for conditional instructions
 
@@ -1090,7 +1145,8 @@ U8 emu_apply_next_instruction(Emulator* emu) {
             break;
 
         case 0x76: // HALT (- - - -)
-            //TODO: here
+            // until an interrupt is requested (see `emulator_step`)
+            emu->interrupts.halt();
             break;
 
         case 0x78: // LD A,B (- - - -)
@@ -1312,7 +1368,7 @@ CALL_IMPL(ADDRESS); \
 
         case 0xD9: // RETI (- - - -)
             RET_IMPL;
-            //TODO: enable interrupts here
+            emu->interrupts.set_ime(True); // immediately, unlike EI
             break;
 
         case 0xDA: // JP C,a16 (- - - -)
@@ -1383,13 +1439,8 @@ CALL_IMPL(ADDRESS); \
             break;
 
         case 0xF3: // DI (- - - -)
-            /*
-             TODO: here
-
-             This instruction disables interrupts but not immediately.
-             Interrupts are disabled after instruction after DI
-             is executed.
-             */
+            // takes effect immediately (and cancels an EI that hasn't kicked in yet)
+            emu->interrupts.set_ime(False);
             break;
 
         case 0xF5: // PUSH AF (- - - -)
@@ -1420,19 +1471,27 @@ CALL_IMPL(ADDRESS); \
             
         case 0xFB: // EI
             /*
-             TODO: here
-             
              Enable interrupts. This intruction enables interrupts
              but not immediately. Interrupts are enabled after instruction after EI
              is executed.
              */
+            emu->interrupts.enable_ime_after_next_instruction();
             break;
             
         case 0xFE: // CP d8 (Z 1 H C)
             cp_a_impl(direct_u8, r);
             break;
             
-        case 0xD3: // INVALID_INSTRUCTION
+        case 0xD3: // INVALID_INSTRUCTION, also `Debugger::TrapOpcode`
+            if(Config::Breakpoints && emu->debugger.trapped){
+                // stopped by the debugger before the real instruction ran
+                r->pc -= opcode_description.byte_length;
+                emu->debugger.trapped = False;
+                emu->debugger.stopped = True;
+                return 0;
+            }
+            break;
+
         case 0xDB: // INVALID_INSTRUCTION
         case 0xDD: // INVALID_INSTRUCTION
         case 0xE3: // INVALID_INSTRUCTION
@@ -1457,8 +1516,15 @@ CALL_IMPL(ADDRESS); \
             r->pc = opcode - 0xC7;
             break;
     }
-    
-    return opcode_description.cycles + additional_cycles;
+
+    U8 cycles = opcode_description.cycles + additional_cycles + 1; //TODO: why is this + 1? is this right?
+    if(Config::Profiling && emu->profiler){
+        emu_profile_instruction(emu, instr_pc, opcode, opcode_description.byte_length, cycles);
+    }
+    if(Config::Counters){
+        emu->instructions += 1;
+    }
+    return cycles;
 }
 
 void randset(void* dest, size_t size) {
@@ -1467,203 +1533,814 @@ void randset(void* dest, size_t size) {
     }
 }
 
-void emulator_init(Emulator* emu) {
+template<class Config>
+void emulator_init(EmulatorT<Config>* emu) {
     memset(emu->cartridge_ram, 0, sizeof(emu->cartridge_ram));
     memset(emu->internal_ram, 0, sizeof(emu->internal_ram));
-    memset(&emu->hardware_registers, 0, sizeof(emu->hardware_registers));
+    memset(emu->io, 0, sizeof(emu->io));
     memset(emu->zero_page, 0, sizeof(emu->zero_page));
     memset(&emu->oam, 0, sizeof(emu->oam));
     memset(&emu->registers, 0, sizeof(emu->registers));
     memset(&emu->cart, 0, sizeof(emu->cart));
     emu->vram_mutated = False;
+    emu->trace = NULL;
+    emu->profiler = NULL;
+    emu->instructions = 0;
+    memset(&emu->counters, 0, sizeof(emu->counters));
 
     // put random garbage in vram
     randset(&emu->gpu.vram, sizeof(emu->gpu.vram));
+    emu->gpu.reset_vram();
+
+    emu->scheduler.reset();
+    memset(&emu->timer, 0, sizeof(emu->timer));
+    memset(&emu->interrupts, 0, sizeof(emu->interrupts));
+    memset(&emu->serial, 0, sizeof(emu->serial));
+    emu->serial.receive_cycle = Scheduler::Never;
+    emu->serial.peer_used_cycle = Scheduler::Never;
+    emu->apu.reset(Audio::DefaultSampleRate);
+    emu->debugger.reset();
+    emu->dma_active = False;
+    emulator_update_page_table(emu);
 }
 
-void emulator_step(Emulator* emu) {
-    U8 cycles = emu_apply_next_instruction(emu);
-    cycles += 1; //TODO: why is this += 1? is this right?
-
-    emu->gpu.step(cycles);
+// used instead of the real page table while the bus is locked, so every access is slow
+static const PageTable LockedPageTable = {};
 
-    //TODO: update total cycles elapsed in emulator
+// the bus is locked during OAM DMA, and after a watchpoint until the next fetch traps
+template<class Config>
+const PageTable* emu_bus_pages(EmulatorT<Config>* emu) {
+    BOOL32 locked = emu->dma_active || (Config::Breakpoints && emu->debugger.break_pending);
+    return (locked ? &LockedPageTable : &emu->page_table);
 }
 
+/*
+ Points every page that has no side effects straight at its memory. Needs calling again
+ whenever the mapping changes (e.g. the bootstrap ROM being switched off).
+ */
+template<class Config>
+void emulator_update_page_table(EmulatorT<Config>* emu) {
+    PageTable* table = &emu->page_table;
+    memset(table, 0, sizeof(*table));
+
+    // 0x0000 - 0x7FFF: cart ROM. Writes are for bank switching.
+    for(unsigned page = 0x00; page <= 0x7F; ++page){
+        table->read[page] = &emu->cart.data[page << 8];
+    }
+    if(emu->io_register(HardwareRegisters::BootstrapROM) == BootstrapRom_Enabled){
+        table->read[0x00] = BootstrapRom;
+    }
 
+    // 0x8000 - 0x9FFF: video RAM. Reads only, because the GPU has to see writes.
+    for(unsigned page = 0x80; page <= 0x9F; ++page){
+        table->read[page] = &emu->gpu.vram.memory[(page - 0x80) << 8];
+    }
 
-U8 get_hardware_register(Emulator* emu, U16 address) {
-    HardwareRegisters::Registers* hwr = &emu->hardware_registers;
+    // 0xA000 - 0xBFFF: cartridge RAM
+    for(unsigned page = 0xA0; page <= 0xBF; ++page){
+        table->read[page] = table->write[page] = &emu->cartridge_ram[(page - 0xA0) << 8];
+    }
 
-#   define HW_REG_GET(REG_CAPS, REG_SMALL) \
-        case HardwareRegisters::REG_CAPS: \
-            return hwr->REG_SMALL;
+    // 0xC000 - 0xDFFF: internal RAM, and 0xE000 - 0xFDFF: the echo of it
+    for(unsigned page = 0xC0; page <= 0xFD; ++page){
+        table->read[page] = table->write[page] = &emu->internal_ram[(page << 8) & 0x1FFF];
+    }
 
-    switch(address){
-        HW_REG_GET(DIV, div)
-        HW_REG_GET(TIMA, tima)
-        HW_REG_GET(TMA, tma)
-        HW_REG_GET(TAC, tac)
-        HW_REG_GET(NR10, nr10)
-        HW_REG_GET(NR11, nr11)
-        HW_REG_GET(NR12, nr12)
-        HW_REG_GET(NR13, nr13)
-        HW_REG_GET(NR14, nr14)
-        HW_REG_GET(NR21, nr21)
-        HW_REG_GET(NR22, nr22)
-        HW_REG_GET(NR23, nr23)
-        HW_REG_GET(NR24, nr24)
-        HW_REG_GET(NR30, nr30)
-        HW_REG_GET(NR31, nr31)
-        HW_REG_GET(NR32, nr32)
-        HW_REG_GET(NR33, nr33)
-        HW_REG_GET(NR34, nr34)
-        HW_REG_GET(NR41, nr41)
-        HW_REG_GET(NR42, nr42)
-        HW_REG_GET(NR43, nr43)
-        HW_REG_GET(NR44, nr44)
-        HW_REG_GET(NR50, nr50)
-        HW_REG_GET(NR51, nr51)
-        HW_REG_GET(NR52, nr52)
-        HW_REG_GET(LCDC, lcdc)
-        HW_REG_GET(STAT, stat)
-        HW_REG_GET(SCY, scy)
-        HW_REG_GET(SCX, scx)
-
-        case HardwareRegisters::LY:
-            return emu->gpu.line;
-
-        HW_REG_GET(LYC, lyc)
-        HW_REG_GET(DMA, dma)
-        HW_REG_GET(BGP, bgp)
-        HW_REG_GET(OBP0, obp0)
-        HW_REG_GET(OBP1, obp1)
-        HW_REG_GET(WY, wy)
-        HW_REG_GET(WX, wx)
-        HW_REG_GET(P1, p1)
-        HW_REG_GET(SB, sb)
-        HW_REG_GET(SC, sc)
-        HW_REG_GET(IF, if_)
-        HW_REG_GET(BootstrapROM, bootstrap_rom)
-        HW_REG_GET(IE, ie)
+    // 0xFE00 - 0xFFFF: OAM, I/O registers and the zero page all stay slow
 
-        default:
-            if(HardwareRegisters::WavePatternStart <= address && address <= HardwareRegisters::WavePatternEnd){
-                return hwr->wave_pattern[address - HardwareRegisters::WavePatternStart];
-            } else {
-                assert(0); //dunno this register
-                return 0xFF;
+    if(Config::Breakpoints){
+        for(unsigned page = 0x00; page < PageTable::PageCount; ++page){
+            if(emu->debugger.any_slow_reads(page)){
+                table->read[page] = NULL;
             }
+            if(emu->debugger.any_slow_writes(page)){
+                table->write[page] = NULL;
+            }
+        }
+    }
+
+    emu->pages = emu_bus_pages(emu);
+}
+
+/*
+ OAM DMA takes 160 M-cycles, during which the CPU can only get at HRAM. The copy itself
+ happens all at once when it finishes, which nothing running on the CPU can tell apart.
+ */
+const U32 OAMDMACycles = 160 * 4;
+
+template<class Config>
+void emu_start_dma(EmulatorT<Config>* emu) {
+    emu->dma_active = True;
+    emu->pages = &LockedPageTable;
+    emu->scheduler.schedule(Scheduler::Event_DMAComplete, emu->scheduler.cycles + OAMDMACycles);
+}
+
+template<class Config>
+void emu_finish_dma(EmulatorT<Config>* emu) {
+    emu->dma_active = False;
+    emu->pages = emu_bus_pages(emu);
+
+    U8 source_page = emu->io_register(HardwareRegisters::DMA);
+    if(source_page >= 0xE0){
+        source_page -= 0x20; // 0xE000 and up all read from internal RAM
+    }
+
+    const U8* source = emu->page_table.read[source_page];
+    if(source){
+        memcpy(emu->oam.memory, source, sizeof(emu->oam));
+    } else {
+        for(unsigned offset = 0; offset < sizeof(emu->oam); ++offset){
+            emu->oam.memory[offset] = emu->mem_read_slow((source_page << 8) + offset);
+        }
+    }
+
+    for(unsigned offset = 0; offset < sizeof(emu->oam); ++offset){
+        emu->gpu.write_oam(offset, emu->oam.memory[offset]);
+    }
+    emu->vram_mutated = True;
+}
+
+// needs calling whenever the timer registers change
+template<class Config>
+void emu_schedule_timer(EmulatorT<Config>* emu) {
+    emu->scheduler.schedule(Scheduler::Event_TimerOverflow, emu->timer.overflow_deadline());
+}
+
+template<class Config>
+void emu_timer_overflow(EmulatorT<Config>* emu) {
+    // bring TIMA up to the moment it overflowed, which reloads it from TMA
+    U64 overflow_cycle = emu->timer.overflow_deadline();
+    emu->timer.sync(overflow_cycle);
+    emu->interrupts.request(Interrupts::Timer);
+    emu_schedule_timer(emu);
+}
+
+/*
+ Brings the APU up to date and reads out (interleaved stereo) what it has played since the
+ last call, up to `max_samples` pairs. Audio isn't synthesised at all until this is first
+ called.
+ */
+template<class Config>
+U32 emulator_drain_audio(EmulatorT<Config>* emu, S16* out, U32 max_samples) {
+    if(!Config::AudioSynthesis)
+        return 0;
+
+    U64 now = emu->scheduler.cycles;
+    emu->apu.set_output_enabled(True, now);
+    emu->apu.end_frame(now);
+    return emu->apu.read_samples(out, max_samples);
+}
+
+/*
+ Plugs a cable between two emulators. Each one only ever pushes into its own outbox, so
+ they can be stepped on separate threads.
+ */
+template<class Config>
+void emulator_connect_link(EmulatorT<Config>* a, EmulatorT<Config>* b, Serial::LinkCable* cable) {
+    a->serial.outbox = &cable->a_to_b;
+    a->serial.inbox = &cable->b_to_a;
+    a->serial.cycles_out = &cable->a_cycles;
+    a->serial.peer_cycles = &cable->b_cycles;
+    b->serial.outbox = &cable->b_to_a;
+    b->serial.inbox = &cable->a_to_b;
+    b->serial.cycles_out = &cable->b_cycles;
+    b->serial.peer_cycles = &cable->a_cycles;
+
+    EmulatorT<Config>* emus[2] = { a, b };
+    for(int i = 0; i < 2; ++i){
+        emus[i]->serial.cycles_out->store(emus[i]->scheduler.cycles, std::memory_order_release);
+        emus[i]->scheduler.schedule(Scheduler::Event_LinkSync, emus[i]->scheduler.cycles + Serial::SyncCycles);
+    }
+}
+
+// tells the other side how far this one has run, or as far as its writes have gone out
+template<class Config>
+void emu_link_publish(EmulatorT<Config>* emu) {
+    U64 cycle = (emu->serial.has_unsent ? emu->serial.unsent.cycle : emu->scheduler.cycles);
+    emu->serial.cycles_out->store(cycle, std::memory_order_release);
+}
+
+// stops the CPU until the other side has run further, see `Serial::LinkCable`
+template<class Config>
+void emu_link_wait(EmulatorT<Config>* emu) {
+    emu_link_publish(emu);
+    emu->interrupts.set_link_waiting(True);
+}
+
+// while waiting with the external clock, notices the other side starting a transfer that includes this one
+template<class Config>
+void emu_link_check_start(EmulatorT<Config>* emu, const Serial::Message* message) {
+    Serial::Port* port = &emu->serial;
+    BOOL32 listening = (port->sc & (Serial::SCTransferStart | Serial::SCInternalClock)) == Serial::SCTransferStart;
+    BOOL32 driving = (message->sc & (Serial::SCTransferStart | Serial::SCInternalClock)) == (Serial::SCTransferStart | Serial::SCInternalClock);
+    if(listening && driving && message->cycle >= port->start_cycle && port->receive_cycle == Scheduler::Never){
+        port->receive_cycle = message->cycle + Serial::CyclesPerByte;
+        port->receive_value = message->sb;
+    }
+}
+
+/*
+ Takes the other side's SC writes up to and including `cycle` out of the inbox, so `peer`
+ is as it was then. Returns how far the other side is known to have run: any write that
+ hasn't been seen yet is at or after it.
+ */
+template<class Config>
+U64 emu_link_receive(EmulatorT<Config>* emu, U64 cycle) {
+    Serial::Port* port = &emu->serial;
+    // read first, since every write before it was queued before it was published
+    U64 known_until = port->peer_cycles->load(std::memory_order_acquire);
+    while(port->has_next || port->inbox->pop(&port->next)){
+        if(port->next.cycle > cycle){
+            port->has_next = True;
+            return port->next.cycle;
+        }
+        port->peer = port->next;
+        port->has_next = False;
+        emu_link_check_start(emu, &port->peer);
+    }
+    return known_until;
+}
+
+// how far it's safe to take the other side's writes: a transfer this side is driving needs them as of its start
+template<class Config>
+U64 emu_link_receive_limit(EmulatorT<Config>* emu) {
+    const U8 Driving = Serial::SCTransferStart | Serial::SCInternalClock;
+    return ((emu->serial.sc & Driving) == Driving ? emu->serial.start_cycle : emu->scheduler.cycles);
+}
+
+template<class Config>
+void emu_link_sync(EmulatorT<Config>* emu) {
+    emu_link_publish(emu);
+    emu_link_receive(emu, emu_link_receive_limit(emu)); // keeps the inbox from filling up
+    emu->scheduler.schedule(Scheduler::Event_LinkSync, emu->scheduler.cycles + Serial::SyncCycles);
+}
+
+template<class Config>
+void emu_serial_complete(EmulatorT<Config>* emu, U8 received) {
+    emu->serial.sb = received;
+    emu->serial.sc &= ~Serial::SCTransferStart;
+    emu->serial.receive_cycle = Scheduler::Never;
+    emu->serial.bytes_transferred += 1;
+    emu->interrupts.request(Interrupts::Serial);
+}
+
+template<class Config>
+void emu_serial_write_sc(EmulatorT<Config>* emu, U8 value) {
+    Serial::Port* port = &emu->serial;
+    U64 now = emu->scheduler.cycles;
+    port->sc = value;
+    port->receive_cycle = Scheduler::Never;
+    if(port->outbox){
+        Serial::Message message = { now, value, port->sb };
+        EMU_ASSERT(!port->has_unsent); //it waits until that's gone
+        if(!port->outbox->push(message)){
+            // the other side is too far behind to take it, so wait for it to catch up
+            port->unsent = message;
+            port->has_unsent = True;
+            emu_link_wait(emu);
+        }
+    }
+
+    if(!(value & Serial::SCTransferStart)){
+        emu->scheduler.cancel(Scheduler::Event_SerialTransfer);
+        return;
+    }
+
+    port->start_cycle = now;
+    if(value & Serial::SCInternalClock){
+        if(port->capture){
+            port->capture->append(port->sb);
+        }
+        // we drive the clock, so the byte is done 8 bits from now
+        emu->scheduler.schedule(Scheduler::Event_SerialTransfer, now + Serial::CyclesPerByte);
+    } else if(port->inbox){
+        // the other side may have started on this very cycle. If not, it can't finish any sooner than a byte from now
+        emu_link_check_start(emu, &port->peer);
+        emu->scheduler.schedule(Scheduler::Event_SerialTransfer, now + Serial::CyclesPerByte);
     }
-#   undef HW_REG_GET
 }
 
-void set_hardware_register(HardwareRegisters::Registers* hwr, U16 address, U8 value) {
-#   define HW_REG_SET(REG_CAPS, REG_SMALL) \
-        case HardwareRegisters::REG_CAPS: \
-            hwr->REG_SMALL = value; \
+/*
+ With the internal clock, this is the end of the transfer. With the external clock, it's the
+ next point where the other side could have finished a transfer, or the end of the one
+ it did start. See `Serial::LinkCable`.
+ */
+template<class Config>
+void emu_serial_transfer(EmulatorT<Config>* emu) {
+    Serial::Port* port = &emu->serial;
+    U64 now = emu->scheduler.cycles;
+
+    if(port->sc & Serial::SCInternalClock){
+        if(!port->inbox){
+            emu_serial_complete(emu, 0xFF); // nothing plugged in, so nothing is shifted in
             return;
+        }
 
-#   define HW_REG_ZERO(REG_CAPS, REG_SMALL) \
-        case HardwareRegisters::REG_CAPS: \
-            hwr->REG_SMALL = 0; \
+        // whether the other side was listening when this transfer started
+        U64 known_until = emu_link_receive(emu, port->start_cycle);
+        if(known_until <= port->start_cycle){
+            port->transfer_waiting = True;
+            emu_link_wait(emu);
             return;
+        }
+        // and hasn't already been finished by an earlier transfer from this side
+        BOOL32 listening = ((port->peer.sc & (Serial::SCTransferStart | Serial::SCInternalClock)) == Serial::SCTransferStart &&
+                            port->peer.cycle != port->peer_used_cycle);
+        if(listening){
+            port->peer_used_cycle = port->peer.cycle;
+        }
+        emu_serial_complete(emu, listening ? port->peer.sb : 0xFF);
+    } else {
+        U64 known_until = emu_link_receive(emu, now);
+        if(port->receive_cycle != Scheduler::Never){
+            if(now >= port->receive_cycle){
+                emu_serial_complete(emu, port->receive_value);
+            } else {
+                emu->scheduler.schedule(Scheduler::Event_SerialTransfer, port->receive_cycle);
+            }
+        } else if(known_until + Serial::CyclesPerByte <= now){
+            port->transfer_waiting = True;
+            emu_link_wait(emu); // it might yet start a transfer that should already have finished
+        } else {
+            emu->scheduler.schedule(Scheduler::Event_SerialTransfer, known_until + Serial::CyclesPerByte);
+        }
+    }
+}
 
-    switch(address){
-        HW_REG_ZERO(DIV, div)
-        HW_REG_SET(TIMA, tima)
-        HW_REG_SET(TMA, tma)
-        HW_REG_SET(TAC, tac)
-        HW_REG_SET(NR10, nr10)
-        HW_REG_SET(NR11, nr11)
-        HW_REG_SET(NR12, nr12)
-        HW_REG_SET(NR13, nr13)
-        HW_REG_SET(NR14, nr14)
-        HW_REG_SET(NR21, nr21)
-        HW_REG_SET(NR22, nr22)
-        HW_REG_SET(NR23, nr23)
-        HW_REG_SET(NR24, nr24)
-        HW_REG_SET(NR30, nr30)
-        HW_REG_SET(NR31, nr31)
-        HW_REG_SET(NR32, nr32)
-        HW_REG_SET(NR33, nr33)
-        HW_REG_SET(NR34, nr34)
-        HW_REG_SET(NR41, nr41)
-        HW_REG_SET(NR42, nr42)
-        HW_REG_SET(NR43, nr43)
-        HW_REG_SET(NR44, nr44)
-        HW_REG_SET(NR50, nr50)
-        HW_REG_SET(NR51, nr51)
-        HW_REG_SET(NR52, nr52)
-        HW_REG_SET(LCDC, lcdc)
-        HW_REG_SET(STAT, stat)
-        HW_REG_SET(SCY, scy)
-        HW_REG_SET(SCX, scx)
-
-        case HardwareRegisters::LY:
-            //TODO: is this writable? source says it's read only, but also says it zeros on write
-            //treating as read-only for now.
+// tries again whatever the CPU was waiting on the link cable for
+template<class Config>
+void emu_link_resume(EmulatorT<Config>* emu) {
+    Serial::Port* port = &emu->serial;
+    if(port->has_unsent){
+        if(!port->outbox->push(port->unsent)){
+            emu_link_wait(emu);
             return;
+        }
+        port->has_unsent = False;
+    }
+    if(port->transfer_waiting){
+        port->transfer_waiting = False;
+        emu_serial_transfer(emu);
+    }
+}
 
-        HW_REG_SET(LYC, lyc)
-        HW_REG_SET(DMA, dma)
-        HW_REG_SET(BGP, bgp)
-        HW_REG_SET(OBP0, obp0)
-        HW_REG_SET(OBP1, obp1)
-        HW_REG_SET(WY, wy)
-        HW_REG_SET(WX, wx)
-        HW_REG_SET(P1, p1)
-        HW_REG_SET(SB, sb)
-        HW_REG_SET(SC, sc)
-        HW_REG_SET(IF, if_)
-        HW_REG_SET(BootstrapROM, bootstrap_rom)
-        HW_REG_SET(IE, ie)
+template<class Config>
+void emu_handle_events(EmulatorT<Config>* emu) {
+    Scheduler::Event event;
+    while(emu->scheduler.pop_due_event(&event)){
+        switch(event){
+            case Scheduler::Event_DMAComplete:
+                emu_finish_dma(emu);
+                break;
+
+            case Scheduler::Event_TimerOverflow:
+                emu_timer_overflow(emu);
+                break;
+
+            case Scheduler::Event_SerialTransfer:
+                emu_serial_transfer(emu);
+                break;
+
+            case Scheduler::Event_LinkSync:
+                emu_link_sync(emu);
+                break;
+
+            case Scheduler::EventCount:
+                EMU_ASSERT(0); //not an event
+                break;
+        }
+    }
+}
 
-        default:
-            if(HardwareRegisters::WavePatternStart <= address && address <= HardwareRegisters::WavePatternEnd){
-                hwr->wave_pattern[address - HardwareRegisters::WavePatternStart] = value;
-            } else {
-                assert(0); //dunno this register
+// pushes PC and jumps to the highest priority pending interrupt
+template<class Config>
+U8 emu_dispatch_interrupt(EmulatorT<Config>* emu) {
+    Interrupts::Controller* ic = &emu->interrupts;
+    U8 pending = ic->pending();
+    EMU_ASSERT(pending);
+
+    unsigned interrupt_idx = __builtin_ctz(pending);
+    ic->if_ &= ~(1 << interrupt_idx);
+    ic->set_ime(False);
+
+    U16 return_address = emu->registers.pc;
+    U16 vector = Interrupts::VectorAddresses[interrupt_idx];
+    emu->stack_push(return_address);
+    emu->registers.pc = vector;
+
+    if(Config::Profiling && emu->profiler){
+        U8 bank = emu_rom_bank(emu, vector);
+        emu->profiler->call(vector, bank, return_address, True);
+        emu->profiler->add_cycles(vector, bank, Interrupts::DispatchCycles);
+    }
+    return Interrupts::DispatchCycles;
+}
+
+/*
+ Only used when `interrupts.attention` is set: an interrupt might need servicing, the CPU is
+ halted, or an EI is waiting to take effect.
+ */
+template<class Config>
+U8 emu_step_with_interrupts(EmulatorT<Config>* emu) {
+    Interrupts::Controller* ic = &emu->interrupts;
+
+    if(ic->link_waiting){
+        ic->set_link_waiting(False);
+        emu_link_resume(emu); // may well wait again
+        if(ic->link_waiting)
+            return 0;
+    }
+
+    if(ic->halted){
+        if(!ic->pending()){
+            if(Config::Profiling && emu->profiler){
+                U16 pc = emu->registers.pc;
+                emu->profiler->add_cycles(pc, emu_rom_bank(emu, pc), Interrupts::HaltedCycles);
+            }
+            if(Config::Counters){
+                emu->counters.halted_cycles += Interrupts::HaltedCycles;
             }
+            return Interrupts::HaltedCycles;
+        }
+
+        // any requested interrupt wakes the CPU up, even if IME is off
+        ic->halted = False;
+        ic->update_attention();
+    }
+
+    if(ic->ime && ic->pending()){
+        return emu_dispatch_interrupt(emu);
+    }
+
+    BOOL32 enabling_ime = ic->ime_enable_pending;
+    U8 cycles = emu_apply_next_instruction(emu);
+
+    // EI takes effect after the instruction following it, unless that was a DI (or it never
+    // ran, because the debugger stopped in front of it)
+    if(enabling_ime && ic->ime_enable_pending && cycles != 0){
+        ic->set_ime(True);
+    }
+    return cycles;
+}
+
+template<class Config>
+void emulator_step(EmulatorT<Config>* emu) {
+    U8 cycles;
+    if(emu->interrupts.attention){
+        cycles = emu_step_with_interrupts(emu);
+    } else {
+        cycles = emu_apply_next_instruction(emu);
+    }
+
+    emu->scheduler.cycles += cycles;
+    U8 gpu_interrupts = emu->gpu.template step<Config>(cycles);
+    if(gpu_interrupts){
+        emu->interrupts.request(gpu_interrupts);
+    }
+
+    if(emu->scheduler.any_due()){
+        emu_handle_events(emu);
+    }
+}
+
+template<class Config>
+void emulator_run_until_frame(EmulatorT<Config>* emu, U32 frame_number) {
+    U64 start_ns = (Config::Counters ? Counters::now_ns() : 0);
+    while(emu->gpu.frame_number < frame_number){
+        emulator_step(emu);
+        if(Config::Breakpoints && emu->debugger.stopped)
+            break;
+        if(emu->interrupts.link_waiting)
+            break;
+    }
+    if(emu->serial.cycles_out){
+        emu_link_publish(emu);
+    }
+    if(Config::Counters){
+        emu->counters.run_ns += Counters::now_ns() - start_ns;
+    }
+}
+
+template<class Config>
+void emulator_counters(EmulatorT<Config>* emu, Counters::Snapshot* out) {
+    const Counters::Counters* counters = &emu->counters;
+    U64 gpu_ns = emu->gpu.render_ns;
+
+    out->instructions = emu->instructions;
+    out->cycles = emu->scheduler.cycles;
+    out->frames = emu->gpu.frame_number;
+    out->halted_cycles = counters->halted_cycles;
+    out->slow_reads = counters->slow_reads;
+    out->slow_writes = counters->slow_writes;
+    // rendering can also happen outside a run (e.g. the frontend asking for the debug views)
+    out->cpu_ns = (counters->run_ns > gpu_ns ? counters->run_ns - gpu_ns : 0);
+    out->gpu_ns = gpu_ns;
+    out->render_thread_ns = emu->gpu.render_thread_ns.load(std::memory_order_relaxed);
+    out->frontend_ns = counters->frontend_ns;
+}
+
+template<class Config>
+void emulator_set_breakpoint(EmulatorT<Config>* emu, U16 address, BOOL32 enabled) {
+    emu->debugger.set_breakpoint(address, enabled);
+    emulator_update_page_table(emu);
+}
+
+template<class Config>
+void emulator_set_watchpoint(EmulatorT<Config>* emu, U16 address, U8 kinds, BOOL32 enabled) {
+    emu->debugger.set_watchpoint(address, kinds, enabled);
+    emulator_update_page_table(emu);
+}
+
+template<class Config>
+void emulator_resume(EmulatorT<Config>* emu) {
+    Debugger::Debugger* debugger = &emu->debugger;
+    debugger->stopped = False;
+    debugger->break_pending = False; // e.g. the frontend reading a watched address while stopped
+    debugger->resume_address = emu->registers.pc;
+    emu->pages = emu_bus_pages(emu);
+}
+
+// stops after the current instruction, by making the next fetch slow
+template<class Config>
+void emu_watchpoint_hit(EmulatorT<Config>* emu, U16 address, Debugger::WatchKind kind) {
+    emu->debugger.break_pending = True;
+    emu->debugger.hit_address = address;
+    emu->debugger.hit_kind = kind;
+    emu->pages = &LockedPageTable;
+}
+
+
+
+/*
+ Every I/O register (0xFF00 - 0xFF7F, and IE) has an entry in `IORegisters::table`. Registers
+ whose reads and writes have no side effects live in `io` and are loaded and stored directly,
+ with `read_mask` setting the bits that always read as 1 (all of them, for unused addresses).
+
+ The rest have handlers, so the subsystem that owns the register can catch up to the current
+ cycle first (the timer, the GPU, the APU) or react to the write (DMA, the bootstrap ROM).
+ A handler's read still gets `read_mask` applied, and a write handler decides for itself
+ whether the value also goes into `io`.
+ */
+template<class Config>
+struct IORegister {
+    U8 (*read)(EmulatorT<Config>* emu, U16 address); // NULL to read `io`
+    void (*write)(EmulatorT<Config>* emu, U16 address, U8 value); // NULL to write `io`
+    U8 read_mask;
+};
+
+template<class Config>
+U8 io_read_div(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->timer.div(emu->scheduler.cycles);
+}
+
+template<class Config>
+U8 io_read_tima(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->timer.tima(emu->scheduler.cycles);
+}
+
+// DIV, TIMA, TMA and TAC
+template<class Config>
+void io_write_timer(EmulatorT<Config>* emu, U16 address, U8 value) {
+    U64 now = emu->scheduler.cycles;
+    emu->io_register(address) = value;
+
+    switch(address){
+        case HardwareRegisters::DIV: emu->timer.write_div(now); break; // any write resets it
+        case HardwareRegisters::TIMA: emu->timer.write_tima(now, value); break;
+        case HardwareRegisters::TMA: emu->timer.write_tma(now, value); break;
+        case HardwareRegisters::TAC: emu->timer.write_tac(now, value); break;
+    }
+    emu_schedule_timer(emu);
+}
+
+template<class Config>
+U8 io_read_sb(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->serial.sb; // a transfer shifts the received byte in
+}
+
+template<class Config>
+void io_write_sb(EmulatorT<Config>* emu, U16 /*address*/, U8 value) {
+    emu->serial.sb = value;
+}
+
+template<class Config>
+U8 io_read_sc(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->serial.sc;
+}
+
+template<class Config>
+void io_write_sc(EmulatorT<Config>* emu, U16 /*address*/, U8 value) {
+    emu_serial_write_sc(emu, value);
+}
+
+template<class Config>
+U8 io_read_if(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->interrupts.if_;
+}
+
+template<class Config>
+void io_write_if(EmulatorT<Config>* emu, U16 /*address*/, U8 value) {
+    emu->interrupts.write_if(value);
+}
+
+template<class Config>
+void io_write_ie(EmulatorT<Config>* emu, U16 address, U8 value) {
+    emu->io_register(address) = value;
+    emu->interrupts.write_ie(value);
+}
+
+template<class Config>
+U8 io_read_stat(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->gpu.stat();
+}
+
+template<class Config>
+U8 io_read_ly(EmulatorT<Config>* emu, U16 /*address*/) {
+    return emu->gpu.line;
+}
+
+// LCDC, STAT, SCY, SCX, LYC, the palettes, WY and WX
+template<class Config>
+void io_write_gpu(EmulatorT<Config>* emu, U16 address, U8 value) {
+    emu->io_register(address) = value;
+    emu->gpu.write_register(address, value);
+}
+
+template<class Config>
+void io_write_ignored(EmulatorT<Config>* /*emu*/, U16 /*address*/, U8 /*value*/) {
+    //TODO: LY: is this writable? source says it's read only, but also says it zeros on write
+    //treating as read-only for now.
+}
+
+template<class Config>
+void io_write_dma(EmulatorT<Config>* emu, U16 address, U8 value) {
+    emu->io_register(address) = value;
+    emu_start_dma(emu);
+}
+
+template<class Config>
+void io_write_bootstrap_rom(EmulatorT<Config>* emu, U16 address, U8 value) {
+    emu->io_register(address) = value;
+    emulator_update_page_table(emu);
+}
+
+template<class Config>
+U8 io_read_audio(EmulatorT<Config>* emu, U16 address) {
+    if(!Config::AudioSynthesis)
+        return emu->apu.peek_register(address);
+    return emu->apu.read_register(address, emu->scheduler.cycles);
+}
+
+template<class Config>
+void io_write_audio(EmulatorT<Config>* emu, U16 address, U8 value) {
+    if(!Config::AudioSynthesis){
+        emu->apu.store_register(address, value);
+        return;
+    }
+    emu->apu.write_register(address, value, emu->scheduler.cycles);
+}
+
+template<class Config>
+struct IORegisters {
+    static const IORegister<Config> table[HardwareRegisters::IOCount];
+};
+
+#define IO_REGISTER(READ, WRITE, MASK) { READ, WRITE, MASK }
+#define IO_PLAIN(MASK) { NULL, NULL, MASK }
+#define IO_UNUSED { NULL, NULL, 0xFF }
+#define IO_AUDIO { io_read_audio<Config>, io_write_audio<Config>, 0x00 }
+
+template<class Config>
+const IORegister<Config> IORegisters<Config>::table[HardwareRegisters::IOCount] = {
+    /* FF00 P1           */ IO_PLAIN(0xC0),
+    /* FF01 SB           */ IO_REGISTER(io_read_sb<Config>, io_write_sb<Config>, 0x00),
+    /* FF02 SC           */ IO_REGISTER(io_read_sc<Config>, io_write_sc<Config>, 0x7E),
+    /* FF03: unused */
+    IO_UNUSED,
+    /* FF04 DIV          */ IO_REGISTER(io_read_div<Config>, io_write_timer<Config>, 0x00),
+    /* FF05 TIMA         */ IO_REGISTER(io_read_tima<Config>, io_write_timer<Config>, 0x00),
+    /* FF06 TMA          */ IO_REGISTER(NULL, io_write_timer<Config>, 0x00),
+    /* FF07 TAC          */ IO_REGISTER(NULL, io_write_timer<Config>, 0xF8),
+    /* FF08 - FF0E: unused */
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    /* FF0F IF           */ IO_REGISTER(io_read_if<Config>, io_write_if<Config>, 0xE0),
+    /* FF10 - FF3F: audio registers and wave RAM */
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO, IO_AUDIO,
+    /* FF40 LCDC         */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF41 STAT         */ IO_REGISTER(io_read_stat<Config>, io_write_gpu<Config>, 0x00),
+    /* FF42 SCY          */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF43 SCX          */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF44 LY           */ IO_REGISTER(io_read_ly<Config>, io_write_ignored<Config>, 0x00),
+    /* FF45 LYC          */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF46 DMA          */ IO_REGISTER(NULL, io_write_dma<Config>, 0x00),
+    /* FF47 BGP          */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF48 OBP0         */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF49 OBP1         */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF4A WY           */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF4B WX           */ IO_REGISTER(NULL, io_write_gpu<Config>, 0x00),
+    /* FF4C - FF4F: unused */
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    /* FF50 BootstrapROM */ IO_REGISTER(NULL, io_write_bootstrap_rom<Config>, 0x00),
+    /* FF51 - FF7F: unused */
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED, IO_UNUSED,
+    /* FFFF IE           */ IO_REGISTER(NULL, io_write_ie<Config>, 0x00),
+};
+
+#undef IO_REGISTER
+#undef IO_PLAIN
+#undef IO_UNUSED
+#undef IO_AUDIO
+
+template<class Config>
+U8 get_hardware_register(EmulatorT<Config>* emu, U16 address) {
+    unsigned index = HardwareRegisters::io_index(address);
+    const IORegister<Config>* reg = &IORegisters<Config>::table[index];
+    U8 value = reg->read ? reg->read(emu, address) : emu->io[index];
+    return value | reg->read_mask;
+}
+
+template<class Config>
+void set_hardware_register(EmulatorT<Config>* emu, U16 address, U8 value) {
+    unsigned index = HardwareRegisters::io_index(address);
+    const IORegister<Config>* reg = &IORegisters<Config>::table[index];
+    if(reg->write){
+        reg->write(emu, address, value);
+    } else {
+        emu->io[index] = value;
+    }
+}
+
+template<class Config>
+U8 EmulatorT<Config>::mem_read(U16 address) {
+    const U8* page = pages->read[address >> 8];
+    if(page){
+        return page[address & 0xFF];
+    }
+    return mem_read_slow(address);
+}
+
+template<class Config>
+void EmulatorT<Config>::mem_write(U16 address, U8 value) {
+    U8* page = pages->write[address >> 8];
+    if(page){
+        page[address & 0xFF] = value;
+        return;
     }
+    mem_write_slow(address, value);
 }
 
-U8 Emulator::mem_read(U16 address) {
+// what's at `address`, without the page table or the debugger
+template<class Config>
+U8 emu_bus_read(EmulatorT<Config>* emu, U16 address) {
+    if(emu->dma_active && (address < 0xFF80 || address > 0xFFFE)){
+        return 0xFF; // bus is busy with DMA
+    }
+
     // 0x0000 - 0x3FFF: bank 0 of cart ROM (not switchable)
     if(address <= 0x3FFF) {
-        if(address <= 0x00FF && hardware_registers.bootstrap_rom == BootstrapRom_Enabled) {
+        if(address <= 0x00FF && emu->io_register(HardwareRegisters::BootstrapROM) == BootstrapRom_Enabled) {
             // bootstrap ROM occupies 0x0000 - 0x00FF, but only if the hardware flag is set
             return BootstrapRom[address];
         } else {
-            return cart.data[address];
+            return emu->cart.data[address];
         }
     }
 
     // 0x4000 - 0x7FFF: switchable cart ROM banks
     else if(address <= 0x7FFF){
         //TODO: implement bank switching
-        return cart.data[address];
+        return emu->cart.data[address];
     }
 
     // 0x8000 - 0x9FFF: video RAM
     else if(address <= 0x9FFF){
-        return gpu.vram.memory[address - 0x8000];
+        return emu->gpu.vram.memory[address - 0x8000];
     }
 
     // 0xA000 - 0xBFFF: cartrige RAM
     else if(address <= 0xBFFF) {
-        return cartridge_ram[address - 0xA000];
+        return emu->cartridge_ram[address - 0xA000];
     }
 
     // 0xC000 - 0xDFFF: Internal RAM
     // 0xE000 - 0xFDFF: Echo of internal RAM
     else if(address <= 0xFDFF) {
-        return internal_ram[address & 0x1FFF];
+        return emu->internal_ram[address & 0x1FFF];
     }
 
     // 0xFE00 - 0xFE9F: OAM - Object/Sprite Attribute Memory
     else if(address <= 0xFE9F) {
-        return oam.memory[address - 0xFE00];
+        return emu->oam.memory[address - 0xFE00];
     }
 
     // 0xFEA0 - 0xFEFF: Unusable Memory
@@ -1674,30 +2351,80 @@ U8 Emulator::mem_read(U16 address) {
     // 0xFF00 - 0xFF7F: Hardware I/O Registers
     // 0xFFFF: Interrupt Enable Flag
     else if(address <= 0xFF7F || address == 0xFFFF) {
-        return get_hardware_register(this, address);
+        return get_hardware_register(emu, address);
     }
 
     // 0xFF80 - 0xFFFE: Zero Page
     else if(address <= 0xFFFE) {
-        return zero_page[address - 0xFF80];
+        return emu->zero_page[address - 0xFF80];
     }
 
-    assert(0); //should never get here. All addresses should be covered
+    EMU_ASSERT(0); //should never get here. All addresses should be covered
+    return 0xFF;
+}
+
+template<class Config>
+U8 EmulatorT<Config>::mem_fetch(U16 address) {
+    const U8* page = pages->read[address >> 8];
+    if(page){
+        return page[address & 0xFF];
+    }
+    return mem_fetch_slow(address);
+}
+
+template<class Config>
+U8 EmulatorT<Config>::mem_fetch_slow(U16 address) {
+    if(Config::Breakpoints && debugger.should_trap(address)){
+        debugger.trapped = True;
+        debugger.break_pending = False;
+        pages = emu_bus_pages(this);
+        return Debugger::TrapOpcode;
+    }
+    if(Config::Counters){
+        counters.slow_reads += 1;
+    }
+    return emu_bus_read(this, address); // executing isn't reading, as far as read watchpoints go
 }
 
-void Emulator::mem_write(U16 address, U8 value) {
+template<class Config>
+U8 EmulatorT<Config>::mem_read_slow(U16 address) {
+    if(Config::Counters){
+        counters.slow_reads += 1;
+    }
+    if(Config::Breakpoints && debugger.is_watched(address, Debugger::Watch_Read)){
+        emu_watchpoint_hit(this, address, Debugger::Watch_Read);
+    }
+    return emu_bus_read(this, address);
+}
+
+
+template<class Config>
+void EmulatorT<Config>::mem_write_slow(U16 address, U8 value) {
+    if(Config::Counters){
+        counters.slow_writes += 1;
+    }
+    if(Config::Breakpoints && debugger.is_watched(address, Debugger::Watch_Write)){
+        emu_watchpoint_hit(this, address, Debugger::Watch_Write);
+    }
+
+    if(dma_active && (address < 0xFF80 || address > 0xFFFE)){
+        return; // bus is busy with DMA
+    }
+
     // 0x0000 - 0x3FFF: bank 0 of cart ROM (not switchable)
     // 0x4000 - 0x7FFF: switchable cart ROM banks
     if(address <= 0x7FFF){
         //TODO: writing into this area does memory bank switching
-        assert(0);
+        EMU_ASSERT(0);
         return;
     }
 
     // 0x8000 - 0x9FFF: video RAM
     else if(address <= 0x9FFF){
-        vram_mutated = True;
-        gpu.vram.memory[address - 0x8000] = value;
+        if(Config::DebugViews){
+            vram_mutated = True;
+        }
+        gpu.write_vram(address - 0x8000, value);
         return;
     }
 
@@ -1716,21 +2443,24 @@ void Emulator::mem_write(U16 address, U8 value) {
 
     // 0xFE00 - 0xFE9F: OAM - Object Attribute Memory
     else if(address <= 0xFE9F) {
-        vram_mutated = True;
+        if(Config::DebugViews){
+            vram_mutated = True;
+        }
         oam.memory[address - 0xFE00] = value;
+        gpu.write_oam(address - 0xFE00, value);
         return;
     }
 
     // 0xFEA0 - 0xFEFF: Unusable Memory
     else if(address <= 0xFEFF) {
-        assert(0); //TODO: what happens when writing to unusable memory?
+        EMU_ASSERT(0); //TODO: what happens when writing to unusable memory?
         return;
     }
 
     // 0xFF00 - 0xFF7F: Hardware I/O Registers
     // 0xFFFF: Interrupt Enable Flag
     else if(address <= 0xFF7F || address == 0xFFFF) {
-        set_hardware_register(&hardware_registers, address, value);
+        set_hardware_register(this, address, value);
         return;
     }
 
@@ -1740,10 +2470,11 @@ void Emulator::mem_write(U16 address, U8 value) {
         return;
     }
 
-    assert(0); //should never get here. All addresses should be covered
+    EMU_ASSERT(0); //should never get here. All addresses should be covered
 }
 
-U16 Emulator::mem_read_16(U16 address) {
+template<class Config>
+U16 EmulatorT<Config>::mem_read_16(U16 address) {
     U16 value = 0;
     U8* bytes = (U8*)&value;
     bytes[0] = mem_read(address);
@@ -1751,19 +2482,51 @@ U16 Emulator::mem_read_16(U16 address) {
     return value;
 }
 
-void Emulator::mem_write_16(U16 address, U16 value) {
+template<class Config>
+void EmulatorT<Config>::mem_write_16(U16 address, U16 value) {
     U8* bytes = (U8*)&value;
     mem_write(address, bytes[0]);
     mem_write(address+1, bytes[1]);
 }
 
-U16 Emulator::stack_pop() {
+template<class Config>
+U16 EmulatorT<Config>::stack_pop() {
     U16 retval = mem_read_16(registers.sp);
     registers.sp += 2;
     return retval;
 }
 
-void Emulator::stack_push(U16 value) {
+template<class Config>
+void EmulatorT<Config>::stack_push(U16 value) {
     registers.sp -= 2;
     mem_write_16(registers.sp, value);
 }
+
+
+// see the layout comment at the top of `EmulatorT`
+static_assert(offsetof(Emulator, gpu) + offsetof(Video::GPU, vram) <= 128, "the per-instruction state should fit in two cache lines");
+static_assert(offsetof(HeadlessEmulator, gpu) + offsetof(Video::GPU, vram) <= 128, "the per-instruction state should fit in two cache lines");
+
+template struct EmulatorT<DesktopConfig>;
+template void emulator_init(Emulator* emu);
+template void emulator_step(Emulator* emu);
+template void emulator_update_page_table(Emulator* emu);
+template U32 emulator_drain_audio(Emulator* emu, S16* out, U32 max_samples);
+template void emulator_connect_link(Emulator* a, Emulator* b, Serial::LinkCable* cable);
+template void emulator_set_breakpoint(Emulator* emu, U16 address, BOOL32 enabled);
+template void emulator_set_watchpoint(Emulator* emu, U16 address, U8 kinds, BOOL32 enabled);
+template void emulator_resume(Emulator* emu);
+template void emulator_run_until_frame(Emulator* emu, U32 frame_number);
+template void emulator_counters(Emulator* emu, Counters::Snapshot* out);
+
+template struct EmulatorT<HeadlessConfig>;
+template void emulator_init(HeadlessEmulator* emu);
+template void emulator_step(HeadlessEmulator* emu);
+template void emulator_update_page_table(HeadlessEmulator* emu);
+template U32 emulator_drain_audio(HeadlessEmulator* emu, S16* out, U32 max_samples);
+template void emulator_connect_link(HeadlessEmulator* a, HeadlessEmulator* b, Serial::LinkCable* cable);
+template void emulator_set_breakpoint(HeadlessEmulator* emu, U16 address, BOOL32 enabled);
+template void emulator_set_watchpoint(HeadlessEmulator* emu, U16 address, U8 kinds, BOOL32 enabled);
+template void emulator_resume(HeadlessEmulator* emu);
+template void emulator_run_until_frame(HeadlessEmulator* emu, U32 frame_number);
+template void emulator_counters(HeadlessEmulator* emu, Counters::Snapshot* out);
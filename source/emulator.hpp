@@ -8,38 +8,105 @@
 
 #pragma once
 
+#include "config.hpp"
 #include "cpu.hpp"
 #include "cart.hpp"
 #include "hardware_registers.hpp"
 #include "video.hpp"
+#include "scheduler.hpp"
+#include "timer.hpp"
+#include "interrupts.hpp"
+#include "serial.hpp"
+#include "audio.hpp"
+#include "debugger.hpp"
+#include "trace.hpp"
+#include "profiler.hpp"
+#include "counters.hpp"
 
-struct Emulator {
-    U8 cartridge_ram[0x2000];
-    U8 internal_ram[0x2000];
-    HardwareRegisters::Registers hardware_registers;
-    U8 zero_page[128];
-    Video::OAM oam;
-    Video::GPU gpu;
+/*
+ The address space, split into 256 byte pages. Each entry points straight at the memory
+ backing that page, or is NULL if accesses have to go through `mem_read_slow` /
+ `mem_write_slow` (e.g. because they have side effects, like VRAM and the I/O registers, or
+ because the debugger is watching them).
+ */
+struct PageTable {
+    static const unsigned PageCount = 256;
 
+    const U8* read[PageCount];
+    U8* write[PageCount];
+};
+
+template<class Config>
+struct EmulatorT {
+    /*
+     Everything the run loop touches on every instruction comes first, so it all sits in the
+     first two cache lines, up to and including the GPU's timing state at the front of `GPU`
+     (checked in emulator.cpp). `trace` and `profiler` are only read in configs that have
+     them, so they come after the GPU. The bulk memory, which is mostly reached through
+     `pages`, is kept out of the way at the end, with the 8MB cart last of all.
+     */
     CPU::Registers registers;
-    Cart::Cart cart;
+    BOOL32 dma_active; // the CPU can only access HRAM while OAM DMA is running
+    const PageTable* pages; // `page_table`, or an empty table while the bus is locked
+    Scheduler::Scheduler scheduler;
+    Interrupts::Controller interrupts;
+    U64 instructions; // only counted if `Config::Counters`
+    Video::GPU gpu;
+
+    Trace::Ring* trace; // NULL unless tracing, and only used if `Config::Tracing`
+    Profiler::Profiler* profiler; // NULL unless profiling, and only used if `Config::Profiling`
+    Timer::Timer timer;
+    Serial::Port serial;
+    U8 io[HardwareRegisters::IOCount]; // see `io_register`
     BOOL32 vram_mutated;
+    PageTable page_table;
+    U8 zero_page[128];
+    Video::OAM oam;
+    U8 cartridge_ram[0x2000];
+    U8 internal_ram[0x2000];
+    Audio::APU apu;
+    Debugger::Debugger debugger; // only used if `Config::Breakpoints`
+    Counters::Counters counters; // only used if `Config::Counters`
+    Cart::Cart cart;
 
     /*
      TODO:
-     - cycles elapsed
      - stop instruction
-     - halt instruction
-     - interrupts enabled/disabled
      */
 
     U8 mem_read(U16 address);
     void mem_write(U16 address, U8 value);
+    U8 mem_fetch(U16 address); // an instruction's opcode
+    U8 mem_read_slow(U16 address);
+    U8 mem_fetch_slow(U16 address);
+    void mem_write_slow(U16 address, U8 value);
     U16 mem_read_16(U16 address);
     void mem_write_16(U16 address, U16 value);
     U16 stack_pop();
     void stack_push(U16 value);
+
+    // the stored value of a register in 0xFF00 - 0xFF7F or IE, before any read mask
+    U8& io_register(U16 address) { return io[HardwareRegisters::io_index(address)]; }
 };
 
-void emulator_init(Emulator* emu);
-void emulator_step(Emulator* emu);
+typedef EmulatorT<DesktopConfig> Emulator;
+typedef EmulatorT<HeadlessConfig> HeadlessEmulator;
+
+// instantiated for `DesktopConfig` and `HeadlessConfig` in emulator.cpp
+template<class Config> void emulator_init(EmulatorT<Config>* emu);
+template<class Config> void emulator_step(EmulatorT<Config>* emu);
+template<class Config> void emulator_update_page_table(EmulatorT<Config>* emu);
+template<class Config> U32 emulator_drain_audio(EmulatorT<Config>* emu, S16* out, U32 max_samples);
+template<class Config> void emulator_connect_link(EmulatorT<Config>* a, EmulatorT<Config>* b, Serial::LinkCable* cable);
+
+// steps until `gpu.frame_number` reaches `frame_number`, or the debugger stops it, or it's
+// waiting for the other end of the link cable (`interrupts.link_waiting`)
+template<class Config> void emulator_run_until_frame(EmulatorT<Config>* emu, U32 frame_number);
+// all zero unless `Config::Counters`, apart from the cycles and frames
+template<class Config> void emulator_counters(EmulatorT<Config>* emu, Counters::Snapshot* out);
+
+// these do nothing unless `Config::Breakpoints`. `kinds` is any of `Debugger::WatchKind`
+template<class Config> void emulator_set_breakpoint(EmulatorT<Config>* emu, U16 address, BOOL32 enabled);
+template<class Config> void emulator_set_watchpoint(EmulatorT<Config>* emu, U16 address, U8 kinds, BOOL32 enabled);
+// carries on after `debugger.stopped`, without stopping at the same breakpoint straight away
+template<class Config> void emulator_resume(EmulatorT<Config>* emu);
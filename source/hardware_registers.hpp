@@ -1,5 +1,7 @@
 #pragma once
 
+#include "types.hpp"
+
 namespace HardwareRegisters {
     /*
      P1 (R/W)
@@ -35,6 +37,7 @@ namespace HardwareRegisters {
      */
     static const U16 SB = 0xFF01;
 
+    // SC - see serial.hpp
     static const U16 SC = 0xFF02;
 
     /*
@@ -379,44 +382,32 @@ namespace HardwareRegisters {
      */
     static const U16 IE = 0xFFFF;
 
+    /*
+     The emulator keeps 0xFF00 - 0xFF7F in a 128 byte array, with IE tacked on the end at
+     `IEIndex`. Bit 7 of the address is only set for IE, so the index doesn't need a branch.
+     */
+    const unsigned IOCount = 0x80 + 1;
+    const unsigned IEIndex = 0x80;
+
+    inline unsigned io_index(U16 address) {
+        return (address & 0x7F) + ((address >> 7) & 1);
+    }
+
+    /*
+     The raster registers, as the `GPU` sees them when it draws a line.
+     */
     struct Registers {
-        // timer
-        U8 div;
-        U8 tima;
-        U8 tma;
-        U8 tac;
-
-        // audio
-        U8 nr10;
-        U8 nr11;
-        U8 nr12;
-        U8 nr13;
-        U8 nr14;
-        U8 nr21;
-        U8 nr22;
-        U8 nr23;
-        U8 nr24;
-        U8 nr30;
-        U8 nr31;
-        U8 nr32;
-        U8 nr33;
-        U8 nr34;
-        U8 nr41;
-        U8 nr42;
-        U8 nr43;
-        U8 nr44;
-        U8 nr50;
-        U8 nr51;
-        U8 nr52;
-        U8 wave_pattern[16];
+        // timer registers live in `Timer::Timer`
+
+        // audio registers (and wave RAM) live in `Audio::APU`
 
         // video
         U8 lcdc;
-        U8 stat;
+        //U8 stat; this is built by the `GPU`
         U8 scy;
         U8 scx;
         //U8 ly; this is the `line` element of the `GPU`
-        U8 lyc;
+        //U8 lyc; this is the `lyc` element of the `GPU`
         U8 dma;
         U8 bgp;
         U8 obp0;
@@ -426,11 +417,11 @@ namespace HardwareRegisters {
 
         // misc
         U8 p1;
-        U8 sb;
-        U8 sc;
-        U8 if_;
+        //U8 sb; this is in `Serial::Port`
+        //U8 sc; this is in `Serial::Port`
+        //U8 if_; this is in `Interrupts::Controller`
         U8 bootstrap_rom;
-        U8 ie;
+        //U8 ie; this is in `Interrupts::Controller`
 
         BOOL32 lcdc_bit(U8 bit) {
             U8 mask = 1 << bit;
@@ -440,7 +431,7 @@ namespace HardwareRegisters {
         BOOL32   lcdc_display_enabled() { return lcdc_bit(7); }
         unsigned lcdc_window_tilemap_index()  { return lcdc_bit(6) ? 1 : 0; }
         BOOL32   lcdc_window_enabled() { return lcdc_bit(5); }
-        BOOL32   lcdc_tile_indexes_are_signed() { return lcdc_bit(4); }
+        BOOL32   lcdc_tile_indexes_are_signed() { return !lcdc_bit(4); }
         unsigned lcdc_background_tilemap_index() { return lcdc_bit(3) ? 1 : 0; }
         BOOL32   lcdc_sprites_8x16() { return lcdc_bit(2); }
         BOOL32   lcdc_sprites_enabled() { return lcdc_bit(1); }
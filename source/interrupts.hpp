@@ -0,0 +1,97 @@
+//
+//  interrupts.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include "types.hpp"
+
+namespace Interrupts {
+    /*
+     The bits of IF and IE (see HardwareRegisters::IF). When more than one interrupt is
+     pending, the lowest bit is serviced first.
+     */
+    const U8 VBlank = 0x01;
+    const U8 LCDStat = 0x02;
+    const U8 Timer = 0x04;
+    const U8 Serial = 0x08;
+    const U8 Joypad = 0x10;
+    const U8 AllMask = 0x1F;
+
+    const U16 VectorAddresses[5] = {
+        0x0040, // VBlank
+        0x0048, // LCDStat
+        0x0050, // Timer
+        0x0058, // Serial
+        0x0060, // Joypad
+    };
+
+    /*
+     Servicing an interrupt takes 5 M-cycles: two waits, pushing PC (two cycles) and the jump.
+     */
+    const U8 DispatchCycles = 20;
+
+    // how long each step takes while the CPU is halted
+    const U8 HaltedCycles = 4;
+
+    /*
+     IME is the master switch, set by EI and RETI and cleared by DI and by dispatching
+     an interrupt. EI only takes effect after the instruction that follows it.
+
+     The run loop only looks at `attention`, which is recalculated whenever anything here
+     changes. It's False in the common case: no interrupt is about to be serviced, the CPU
+     isn't halted, no EI is waiting to take effect, and the link cable isn't holding it up.
+     */
+    struct Controller {
+        U8 if_;
+        U8 ie;
+        BOOL32 ime;
+        BOOL32 ime_enable_pending; // EI was the last instruction
+        BOOL32 halted;
+        BOOL32 link_waiting; // stopped, without time passing, until the other end of the link cable catches up
+        BOOL32 attention;
+
+        U8 pending() const { return if_ & ie & AllMask; }
+
+        void update_attention() {
+            attention = halted || link_waiting || ime_enable_pending || (ime && pending());
+        }
+
+        void set_link_waiting(BOOL32 waiting) {
+            link_waiting = waiting;
+            update_attention();
+        }
+
+        void request(U8 flags) {
+            if_ |= flags;
+            update_attention();
+        }
+
+        void write_if(U8 value) {
+            if_ = value & AllMask;
+            update_attention();
+        }
+
+        void write_ie(U8 value) {
+            ie = value;
+            update_attention();
+        }
+
+        void set_ime(BOOL32 enabled) {
+            ime = enabled;
+            ime_enable_pending = False;
+            update_attention();
+        }
+
+        void enable_ime_after_next_instruction() {
+            ime_enable_pending = True;
+            update_attention();
+        }
+
+        void halt() {
+            halted = True;
+            update_attention();
+        }
+    };
+} //namespace Interrupts
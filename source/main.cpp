@@ -10,6 +10,8 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <atomic>
+#include <chrono>
 #include <thread>
 
 #include <SDL2/SDL.h>
@@ -18,11 +20,11 @@
 #include "cart.hpp"
 #include "cpu.hpp"
 #include "emulator.hpp"
+#include "timer.hpp"
+#include "spsc_queue.hpp"
+#include "triple_buffer.hpp"
 
 
-//const U16 BREAKPOINT = 0x006A; // in boot rom, just after finished wating for vblank
-const U16 BREAKPOINT = 0x0000;
-
 void cart_fread(Cart::Cart* cart, const char* filename) {
     FILE* f = fopen(filename, "rb");
     assert(f);
@@ -34,6 +36,27 @@ void cart_fread(Cart::Cart* cart, const char* filename) {
     fclose(f);
 }
 
+/*
+ An otherwise empty cart that the bootstrap ROM accepts, which jumps from the entry point to
+ `program` at 0x0150.
+ */
+Cart::Cart* cart_make_test(const U8* program, U32 size) {
+    Cart::Cart* cart = new Cart::Cart(); // zeroed
+    memcpy(cart->header.nintendo_logo, Cart::NintendoLogo, sizeof(Cart::NintendoLogo));
+
+    const U8 entry_point[4] = { 0x00, 0xC3, 0x50, 0x01 }; // NOP, JP 0x0150
+    memcpy(cart->header.entry_point, entry_point, sizeof(entry_point));
+
+    U8 checksum = 0;
+    for(U32 address = 0x0134; address <= 0x014C; ++address){
+        checksum = checksum - cart->data[address] - 1;
+    }
+    cart->header.header_checksum = checksum;
+
+    memcpy(&cart->data[0x0150], program, size);
+    return cart;
+}
+
 void cart_get_title(Cart::Cart* cart, char* out_title) {
     strncpy(out_title, (const char*)&(cart->header.game_title), Cart::TitleSize - 1);
     out_title[Cart::TitleSize - 1] = 0;
@@ -63,47 +86,46 @@ void test(Emulator* emu) {
     assert(sizeof(Video::TileMap) == 1024);
     assert(sizeof(Video::VRAM) == 0x2000);
     assert(sizeof(Video::OAM) == 160);
+    assert(sizeof(Video::DecodedTile) == 64);
 }
 
-struct BGRA {
-    U8 b;
-    U8 g;
-    U8 r;
-    U8 a;
-};
-
-const BGRA GameboyColorTable[4] = {
-    {0x7B, 0xF7, 0xFF, 0xFF},
-    {0x4A, 0xAE, 0xB5, 0xFF},
-    {0x31, 0x69, 0x6B, 0xFF},
-    {0x10, 0x20, 0x21, 0xFF},
+// RGB for each of the 4 gameboy shades, lightest first
+const U8 GameboyShadeColors[4][3] = {
+    {0xFF, 0xF7, 0x7B},
+    {0xB5, 0xAE, 0x4A},
+    {0x6B, 0x69, 0x31},
+    {0x21, 0x20, 0x10},
 };
 
-BGRA greyscale_to_bgra(int greyscale) {
-    //GB only has 4 colors
-    assert(0 <= greyscale && greyscale <= 3);
-    return GameboyColorTable[greyscale];
+void make_host_palette(Video::HostPixelFormat format, U32 out_palette[4]) {
+    for(int shade = 0; shade < 4; ++shade){
+        const U8* rgb = GameboyShadeColors[shade];
+        out_palette[shade] = Video::host_color(rgb[0], rgb[1], rgb[2], format);
+    }
 }
 
-void update_texture(SDL_Texture* texture, Bitmap* bitmap) {
-    const int bytes_per_pixel = 4;
-
+void update_texture(SDL_Texture* texture, const U8* shades, int width, int height, const U32 palette[4]) {
     U8* pixels = NULL;
     int pitch = 0;
     int lock_result = SDL_LockTexture(texture, NULL, (void**)&pixels, &pitch);
     assert(lock_result == 0);
 
-    for(int y = 0; y < bitmap->height; ++y){
-        for(int x = 0; x < bitmap->width; ++x){
-            BGRA* dest = (BGRA*)(pixels + y*pitch + x*bytes_per_pixel);
-            BGRA src = greyscale_to_bgra(bitmap->getPixel(x, y));
-            *dest = src;
-        }
+    for(int y = 0; y < height; ++y){
+        Video::convert_shades_to_host(shades + y*width,
+                                      width,
+                                      palette,
+                                      Video::HostPixelFormat_ARGB8888,
+                                      pixels + y*pitch);
     }
 
     SDL_UnlockTexture(texture);
 }
 
+void update_texture(SDL_Texture* texture, const U32* argb_pixels, int width, int /*height*/) {
+    int update_result = SDL_UpdateTexture(texture, NULL, argb_pixels, width * sizeof(U32));
+    assert(update_result == 0);
+}
+
 void print_register_info(Emulator* emu) {
     printf("======================\n"
            "AF %0.4X       A %0.2X\n"
@@ -152,16 +174,1316 @@ void print_next_instruction(Emulator* emu) {
     printf("\n");
 }
 
+void print_stop_reason(Emulator* emu) {
+    const Debugger::Debugger* debugger = &emu->debugger;
+    if(debugger->hit_kind == 0){
+        printf("Breaking at %0.4X\n", (unsigned)emu->registers.pc);
+    } else {
+        printf("Breaking at %0.4X, after a %s of %0.4X\n", (unsigned)emu->registers.pc,
+               (debugger->hit_kind == Debugger::Watch_Read ? "read" : "write"),
+               (unsigned)debugger->hit_address);
+    }
+}
+
 void move_window(Emulator* emu, int dx, int dy){
-    emu->hardware_registers.wx += dx;
-    emu->hardware_registers.wy += dy;
+    // through the bus, so that the GPU sees the change
+    emu->mem_write(HardwareRegisters::WX, emu->io_register(HardwareRegisters::WX) + dx);
+    emu->mem_write(HardwareRegisters::WY, emu->io_register(HardwareRegisters::WY) + dy);
     emu->vram_mutated = True;
-    printf("%d/%d\n", (int)emu->hardware_registers.wx, (int)emu->hardware_registers.wy);
+    printf("%d/%d\n", (int)emu->io_register(HardwareRegisters::WX), (int)emu->io_register(HardwareRegisters::WY));
+}
+
+/*
+ A completed frame, handed from the emulation thread to the presentation thread.
+ */
+struct Frame {
+    U32 viewport[Video::ViewportHeight][Video::ViewportWidth]; // ARGB8888, rendered by the GPU
+    char status[128]; // the latest rates from the counters, for the window title
+
+    // only filled in while the debug panel is open
+    BOOL32 has_debug_views;
+    U32 vram_version;
+    U8 tileset[Video::Tileset_PixelsPerColumn][Video::Tileset_PixelsPerRow];
+    U8 window[Video::ScreenBufferSize][Video::ScreenBufferSize];
+    U8 background[Video::ScreenBufferSize][Video::ScreenBufferSize];
+};
+
+/*
+ Keyboard commands, sent from the presentation thread to the emulation thread.
+ */
+enum CommandType {
+    Command_Quit,
+    Command_Step,
+    Command_Step100,
+    Command_PrintRegisters,
+    Command_Continue,
+    Command_Break,
+    Command_MoveWindow,
+};
+
+struct Command {
+    CommandType type;
+    int dx;
+    int dy;
+};
+
+struct AudioSample {
+    S16 left;
+    S16 right;
+};
+
+const U32 AudioRingCapacity = 8192; // ~170ms at 48kHz
+const U32 AudioCallbackSamples = 512;
+const U32 AudioTargetFill = 2400; // 50ms: a few frames, and a few callbacks
+const double AudioMaxRateAdjustment = 0.005; // 0.5% is too small to hear as a change in pitch
+
+/*
+ Everything shared between the threads (including SDL's audio thread). Only the atomics, the
+ queues and the triple buffer are touched by more than one.
+ */
+struct Frontend {
+    Emulator* emu;
+    TripleBuffer<Frame> frames;
+    SPSCQueue<Command, 64> commands;
+    std::atomic<bool> show_debug_views;
+
+    BOOL32 audio_enabled; // there's an audio device. Set before the threads start
+    SPSCQueue<AudioSample, AudioRingCapacity> audio_samples; // emulation thread -> SDL
+    std::atomic<bool> audio_primed; // the ring has filled up, so running dry is an underrun
+    std::atomic<U32> audio_underruns; // callbacks that ran out of samples
+    std::atomic<U32> audio_overruns; // samples dropped because the ring was full
+
+    // the emulation thread reports the counters once a second. Set before the threads start
+    FILE* counters_file; // JSON lines, or NULL
+    std::atomic<U64> presentation_ns; // the presentation thread's work since the last report
+};
+
+const U32 CountersReportFrames = 60;
+
+/*
+ Runs on SDL's audio thread. Never waits for the emulation thread: if there aren't enough
+ samples, the rest is silence.
+ */
+void audio_callback(void* userdata, Uint8* stream, int length) {
+    Frontend* frontend = (Frontend*)userdata;
+    AudioSample* out = (AudioSample*)stream;
+    U32 wanted = (U32)length / sizeof(AudioSample);
+
+    U32 count = frontend->audio_samples.pop_many(out, wanted);
+    if(count < wanted){
+        memset(out + count, 0, (wanted - count) * sizeof(AudioSample));
+        if(frontend->audio_primed.load(std::memory_order_relaxed)){
+            frontend->audio_underruns.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ Hands the frame's samples to the audio thread, steers the APU's output rate towards keeping
+ the ring at `AudioTargetFill`, and then waits for the ring to drain back down to it. That
+ wait is what paces emulation when there's an audio device, so it follows the audio clock.
+ */
+void push_audio(Frontend* frontend) {
+    static AudioSample samples[Audio::SampleCapacity];
+    U64 start_ns = Counters::now_ns();
+
+    U32 fill = frontend->audio_samples.size();
+    double error = ((double)AudioTargetFill - fill) / AudioTargetFill;
+    if(error > 1.0) error = 1.0;
+    if(error < -1.0) error = -1.0;
+
+    U32 count = emulator_drain_audio(frontend->emu, &samples[0].left, Audio::SampleCapacity);
+    frontend->emu->apu.adjust_sample_rate(1.0 + AudioMaxRateAdjustment * error);
+
+    U32 pushed = frontend->audio_samples.push_many(samples, count);
+    if(pushed < count){
+        frontend->audio_overruns.fetch_add(count - pushed, std::memory_order_relaxed);
+    }
+
+    fill += pushed;
+    frontend->emu->counters.frontend_ns += Counters::now_ns() - start_ns;
+    if(fill >= AudioTargetFill){
+        frontend->audio_primed.store(true, std::memory_order_relaxed);
+        U64 excess_us = 1000000ULL * (fill - AudioTargetFill) / Audio::DefaultSampleRate;
+        std::this_thread::sleep_for(std::chrono::microseconds(excess_us));
+    }
+}
+
+// copies a whole bitmap into plain memory that is exactly `bitmap->width` bytes per row
+void copy_bitmap(Bitmap* bitmap, U8* dest) {
+    Bitmap wrapped(bitmap->width, bitmap->height, dest, bitmap->width);
+    wrapped.copyFromBitmap(bitmap, 0, 0, 0, 0, bitmap->width, bitmap->height);
+}
+
+void publish_frame(Frontend* frontend, Video::HostFramebuffer* viewport_output, const char* status) {
+    Emulator* emu = frontend->emu;
+    Frame* frame = frontend->frames.back_buffer();
+    U64 start_ns = Counters::now_ns();
+
+    strcpy(frame->status, status);
+
+    frame->has_debug_views = frontend->show_debug_views.load(std::memory_order_relaxed);
+    if(frame->has_debug_views){
+        copy_bitmap(emu->gpu.tileset_view(), &frame->tileset[0][0]);
+        copy_bitmap(emu->gpu.window_view(), &frame->window[0][0]);
+        copy_bitmap(emu->gpu.background_view(), &frame->background[0][0]);
+        frame->vram_version = emu->gpu.vram_version; // only safe to read once the views are up to date
+    }
+
+    frontend->frames.publish();
+
+    // the GPU renders the next frame straight into the new back buffer
+    viewport_output->pixels = frontend->frames.back_buffer()->viewport;
+    emu->counters.frontend_ns += Counters::now_ns() - start_ns;
+}
+
+/*
+ Writes the counters to `frontend->counters_file`, and describes what each part cost since
+ `last` (as a share of one host core) into `out_status`. Updates `last` and `last_ns`.
+ */
+void report_counters(Frontend* frontend, Counters::Snapshot* last, U64* last_ns, char* out_status, size_t status_size) {
+    Emulator* emu = frontend->emu;
+    emu->counters.frontend_ns += frontend->presentation_ns.exchange(0, std::memory_order_relaxed);
+
+    Counters::Snapshot now;
+    emulator_counters(emu, &now);
+    U64 now_ns = Counters::now_ns();
+    if(frontend->counters_file){
+        Counters::write_json(frontend->counters_file, 0, &now);
+        fflush(frontend->counters_file);
+    }
+
+    double elapsed_ns = (double)(now_ns - *last_ns);
+    snprintf(out_status, status_size, "Gemuboi - %.1f fps, %.2fM instructions/s, cpu %.0f%% gpu %.0f%% render thread %.0f%% frontend %.0f%%",
+             (now.frames - last->frames) * 1e9 / elapsed_ns,
+             (now.instructions - last->instructions) * 1e3 / elapsed_ns,
+             (now.cpu_ns - last->cpu_ns) * 100.0 / elapsed_ns,
+             (now.gpu_ns - last->gpu_ns) * 100.0 / elapsed_ns,
+             (now.render_thread_ns - last->render_thread_ns) * 100.0 / elapsed_ns,
+             (now.frontend_ns - last->frontend_ns) * 100.0 / elapsed_ns);
+
+    *last = now;
+    *last_ns = now_ns;
+}
+
+/*
+ Runs the emulator in real time, publishing each completed frame. Never touches SDL.
+ */
+void emulation_thread(Frontend* frontend) {
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration FrameDuration = std::chrono::nanoseconds(1000000000ULL * 70224 / Timer::CPUClockSpeed);
+
+    Emulator* emu = frontend->emu;
+
+    Video::HostFramebuffer viewport_output;
+    viewport_output.pixels = frontend->frames.back_buffer()->viewport;
+    viewport_output.pitch = Video::ViewportWidth * sizeof(U32);
+    viewport_output.format = Video::HostPixelFormat_ARGB8888;
+    make_host_palette(viewport_output.format, viewport_output.palette);
+    emu->gpu.host_framebuffer = &viewport_output;
+    emu->gpu.set_render_thread(True);
+
+    bool continuing = true;
+    U32 last_frame = emu->gpu.frame_number;
+    Clock::time_point next_frame_time = Clock::now() + FrameDuration;
+
+    char status[sizeof(((Frame*)0)->status)] = "Gemuboi";
+    Counters::Snapshot last_counters;
+    emulator_counters(emu, &last_counters);
+    U64 last_counters_ns = Counters::now_ns();
+
+    while(true){
+        Command command;
+        while(frontend->commands.pop(&command)){
+            switch(command.type){
+                case Command_Quit: return;
+                case Command_Step:
+                    emulator_resume(emu);
+                    emulator_step(emu);
+                    print_next_instruction(emu);
+                    break;
+                case Command_Step100:
+                    emulator_resume(emu);
+                    for(int i = 0; i < 100 && !emu->debugger.stopped; ++i){
+                        emulator_step(emu);
+                    }
+                    break;
+                case Command_PrintRegisters: print_register_info(emu); break;
+                case Command_Continue:
+                    emulator_resume(emu);
+                    continuing = true;
+                    next_frame_time = Clock::now() + FrameDuration;
+                    break;
+                case Command_Break:
+                    continuing = false;
+                    frontend->audio_primed = false; // it's going to run dry, and that's fine
+                    break;
+                case Command_MoveWindow: move_window(emu, command.dx, command.dy); break;
+            }
+        }
+
+        if(!continuing){
+            std::this_thread::sleep_for(std::chrono::milliseconds(1)); //don't check up the CPU too badly
+            continue;
+        }
+
+        // run until the frame is finished, or a breakpoint is hit
+        emulator_run_until_frame(emu, last_frame + 1);
+        if(emu->debugger.stopped){
+            print_stop_reason(emu);
+            continuing = false;
+            frontend->audio_primed = false; // as for Command_Break
+        }
+
+        if(last_frame != emu->gpu.frame_number){
+            last_frame = emu->gpu.frame_number;
+            if(last_frame % CountersReportFrames == 0){
+                report_counters(frontend, &last_counters, &last_counters_ns, status, sizeof(status));
+            }
+            publish_frame(frontend, &viewport_output, status);
+
+            if(frontend->audio_enabled){
+                push_audio(frontend); // paces to the audio clock
+            } else {
+                // pace to the gameboy's refresh rate, but don't try to catch up after a long stall
+                std::this_thread::sleep_until(next_frame_time);
+                next_frame_time += FrameDuration;
+                Clock::time_point now = Clock::now();
+                if(next_frame_time < now){
+                    next_frame_time = now + FrameDuration;
+                }
+            }
+        }
+    }
+}
+
+void send_command(Frontend* frontend, CommandType type, int dx = 0, int dy = 0) {
+    Command command = { type, dx, dy };
+    frontend->commands.push(command);
+}
+
+// FNV-1a over every pixel of the viewport
+U64 frame_hash(Bitmap* viewport) {
+    U64 hash = 14695981039346656037ULL;
+    for(U32 y = 0; y < viewport->height; ++y){
+        const U8* row = viewport->pixelPtr(0, y);
+        for(U32 x = 0; x < viewport->width; ++x){
+            hash = (hash ^ row[x]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/*
+ Runs the cart twice, rendering on the CPU thread and on the render thread, and checks that
+ every frame comes out the same. Returns the number of frames that differed.
+ */
+int compare_render_thread(const Cart::Cart* cart, U32 frame_count, BOOL32 print_frames) {
+    Emulator* emus[2] = { new Emulator, new Emulator };
+    for(int i = 0; i < 2; ++i){
+        srand(0); // same VRAM garbage for both
+        emulator_init(emus[i]);
+        memcpy(&emus[i]->cart, cart, sizeof(*cart));
+    }
+    emus[1]->gpu.set_render_thread(True);
+
+    int mismatches = 0;
+    for(U32 frame = emus[0]->gpu.frame_number + 1; frame <= frame_count; ++frame){
+        emulator_run_until_frame(emus[0], frame);
+        emulator_run_until_frame(emus[1], frame);
+
+        U64 serial_hash = frame_hash(emus[0]->gpu.viewport);
+        U64 threaded_hash = frame_hash(emus[1]->gpu.viewport);
+        if(print_frames){
+            printf("frame %u: %016llx %016llx%s\n", frame,
+                   (unsigned long long)serial_hash, (unsigned long long)threaded_hash,
+                   serial_hash == threaded_hash ? "" : " MISMATCH");
+        }
+        if(serial_hash != threaded_hash){
+            mismatches += 1;
+        }
+    }
+
+    delete emus[0];
+    delete emus[1];
+    return mismatches;
+}
+
+/*
+ Runs a test ROM headless until it prints "Passed" or "Failed" over serial, or until
+ `max_frames` have gone by. Prints whatever the ROM sent. Returns 0 if it passed, 1 if it
+ failed, and 2 if it never said.
+ */
+int run_serial_test(const char* cart_filename, U32 max_frames) {
+    static const char* const patterns[] = { "Passed", "Failed" };
+
+    Emulator* emu = new Emulator;
+    emulator_init(emu);
+    cart_fread(&emu->cart, cart_filename);
+
+    Serial::Capture capture;
+    capture.init(patterns, 2);
+    emu->serial.capture = &capture;
+
+    while(capture.matched_pattern == Serial::NoMatch && emu->gpu.frame_number < max_frames){
+        emulator_step(emu);
+    }
+
+    fwrite(capture.bytes, 1, capture.count, stdout);
+    printf("\n%s after %u frames\n",
+           (capture.matched_pattern == Serial::NoMatch ? "No result" : patterns[capture.matched_pattern]),
+           emu->gpu.frame_number);
+
+    int result = (capture.matched_pattern == Serial::NoMatch ? 2 : (int)capture.matched_pattern);
+    emu->serial.capture = NULL;
+    capture.release();
+    delete emu;
+    return result;
+}
+
+/*
+ Plays all four channels with a new note every frame (as busy as music gets) for `seconds`,
+ and returns how many milliseconds it took. The samples are only drained if
+ `output_enabled`, like a frontend that's playing them.
+ */
+double time_apu(U32 seconds, BOOL32 output_enabled, U32* out_write_count, U32* out_sample_count) {
+    const U32 CyclesPerFrame = 70224;
+    const U32 FramesPerSecond = 60;
+
+    static Audio::APU apu; // too big for the stack
+    static S16 samples[Audio::SampleCapacity * 2];
+    apu.reset(Audio::DefaultSampleRate);
+
+    U64 now = 0;
+    U32 write_count = 0;
+    U32 sample_count = 0;
+#   define APU_WRITE(ADDRESS, VALUE) apu.write_register(HardwareRegisters::ADDRESS, (VALUE), now); write_count += 1;
+
+    apu.set_output_enabled(output_enabled, now);
+    APU_WRITE(NR52, 0x80)
+    APU_WRITE(NR50, 0x77)
+    APU_WRITE(NR51, 0xFF)
+    for(U16 address = HardwareRegisters::WavePatternStart; address <= HardwareRegisters::WavePatternEnd; ++address){
+        apu.write_register(address, (U8)(address * 0x13), now);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for(U32 frame = 0; frame < seconds * FramesPerSecond; ++frame){
+        U64 frame_start = now;
+        U16 frequency = 1024 + ((frame * 37) & 0x3FF);
+
+        APU_WRITE(NR10, 0x15)
+        APU_WRITE(NR11, (frame & 3) << 6)
+        APU_WRITE(NR12, 0xF3)
+        APU_WRITE(NR13, frequency & 0xFF)
+        APU_WRITE(NR14, 0x80 | (frequency >> 8))
+
+        now = frame_start + CyclesPerFrame / 4;
+        APU_WRITE(NR21, 0x80)
+        APU_WRITE(NR22, 0xA7)
+        APU_WRITE(NR23, (frequency + 200) & 0xFF)
+        APU_WRITE(NR24, 0x80 | ((frequency + 200) >> 8))
+
+        now = frame_start + CyclesPerFrame / 2;
+        APU_WRITE(NR30, 0x80)
+        APU_WRITE(NR32, 0x20)
+        APU_WRITE(NR33, (frequency / 2) & 0xFF)
+        APU_WRITE(NR34, 0x80 | ((frequency / 2) >> 8))
+
+        now = frame_start + CyclesPerFrame * 3 / 4;
+        APU_WRITE(NR42, 0xF2)
+        APU_WRITE(NR43, 0x30 | (frame & 0x0F))
+        APU_WRITE(NR44, 0x80)
+
+        now = frame_start + CyclesPerFrame;
+        if(output_enabled){
+            apu.end_frame(now);
+            sample_count += apu.read_samples(samples, Audio::SampleCapacity);
+        }
+    }
+#   undef APU_WRITE
+
+    *out_write_count = write_count;
+    *out_sample_count = sample_count;
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/*
+ Runs the cart up to `frame_count` with the given config, draining the audio each frame like
+ the frontend does, and returns how many milliseconds it took.
+ */
+template<class Config>
+double time_emulator(const char* cart_filename, U32 frame_count) {
+    static S16 samples[Audio::SampleCapacity * 2];
+
+    EmulatorT<Config>* emu = new EmulatorT<Config>;
+    srand(0); // same VRAM garbage for every config
+    emulator_init(emu);
+    cart_fread(&emu->cart, cart_filename);
+
+    auto start = std::chrono::steady_clock::now();
+    for(U32 frame = emu->gpu.frame_number + 1; frame <= frame_count; ++frame){
+        emulator_run_until_frame(emu, frame);
+        emulator_drain_audio(emu, samples, Audio::SampleCapacity);
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    delete emu;
+    return elapsed_ms;
+}
+
+// runs the cart with both configs, one after the other
+void benchmark_configs(const char* cart_filename, U32 frame_count) {
+    double desktop_ms = time_emulator<DesktopConfig>(cart_filename, frame_count);
+    double headless_ms = time_emulator<HeadlessConfig>(cart_filename, frame_count);
+    printf("%u frames\n", frame_count);
+    printf("    desktop:  %.1f ms (%.0f frames per second)\n", desktop_ms, frame_count * 1000.0 / desktop_ms);
+    printf("    headless: %.1f ms (%.0f frames per second)\n", headless_ms, frame_count * 1000.0 / headless_ms);
+}
+
+/*
+ Runs the cart up to `frame_count` without a trace, then again with every instruction traced
+ into a ring in memory (or mapped from `trace_filename`, if it isn't NULL), and prints both.
+ */
+void benchmark_trace(const char* cart_filename, U32 frame_count, const char* trace_filename) {
+    Trace::Ring ring;
+    BOOL32 opened = ring.open(Trace::DefaultCapacity, trace_filename);
+    assert(opened);
+
+    for(int pass = 0; pass < 2; ++pass){
+        BOOL32 tracing = (pass == 1);
+        Emulator* emu = new Emulator;
+        srand(0);
+        emulator_init(emu);
+        cart_fread(&emu->cart, cart_filename);
+        emu->trace = (tracing ? &ring : NULL);
+
+        auto start = std::chrono::steady_clock::now();
+        emulator_run_until_frame(emu, frame_count);
+        double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        printf("%s: %.1f ms (%.0f frames per second)\n", (tracing ? "traced" : "untraced"),
+               elapsed_ms, frame_count * 1000.0 / elapsed_ms);
+        if(tracing){
+            printf("    %llu instructions, %.1fM per second\n",
+                   (unsigned long long)ring.written, ring.written / (elapsed_ms * 1000.0));
+        }
+        delete emu;
+    }
+
+    ring.close();
+}
+
+/*
+ Runs the cart up to `frame_count` with the profiler attached (sampling every `sample_period`
+ cycles, or every instruction if it's 0), writes the folded stacks to `folded_filename`, and
+ prints the busiest addresses and what profiling cost compared to an unprofiled run.
+ */
+void run_profile(const char* cart_filename, U32 frame_count, const char* folded_filename, U32 sample_period) {
+    const unsigned TopCount = 10;
+
+    double unprofiled_ms = 0;
+    double profiled_ms = 0;
+    Profiler::Profiler profiler;
+    profiler.init(sample_period);
+
+    for(int pass = 0; pass < 2; ++pass){
+        BOOL32 profiling = (pass == 1);
+        Emulator* emu = new Emulator;
+        srand(0);
+        emulator_init(emu);
+        cart_fread(&emu->cart, cart_filename);
+        emu->profiler = (profiling ? &profiler : NULL);
+
+        auto start = std::chrono::steady_clock::now();
+        emulator_run_until_frame(emu, frame_count);
+        double elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        (profiling ? profiled_ms : unprofiled_ms) = elapsed_ms;
+        delete emu;
+    }
+
+    FILE* f = fopen(folded_filename, "w");
+    if(f){
+        profiler.write_folded(f);
+        fclose(f);
+    } else {
+        printf("Couldn't write %s\n", folded_filename);
+    }
+
+    printf("%u frames: %.1f ms unprofiled, %.1f ms profiled\n", frame_count, unprofiled_ms, profiled_ms);
+    printf("%llu cycles in %u call chains (%u calls dropped)\n",
+           (unsigned long long)profiler.total_cycles, profiler.node_count, profiler.nodes_dropped);
+
+    // the busiest addresses, picked out one at a time. Slots below `BootstrapSlots` are the bootstrap ROM
+    const U32 BootstrapSlots = 0x100;
+    U32 top[TopCount];
+    unsigned top_count = 0;
+    for(; top_count < TopCount; ++top_count){
+        U32 busiest = 0;
+        U64 busiest_cycles = 0;
+        for(U32 slot = 0; slot < BootstrapSlots + 0x10000; ++slot){
+            BOOL32 taken = False;
+            for(unsigned idx = 0; idx < top_count; ++idx){
+                taken = taken || (top[idx] == slot);
+            }
+            U64 cycles = (slot < BootstrapSlots ? profiler.bootstrap_cycles[slot] : profiler.pc_cycles[slot - BootstrapSlots]);
+            if(!taken && cycles > busiest_cycles){
+                busiest = slot;
+                busiest_cycles = cycles;
+            }
+        }
+        if(busiest_cycles == 0)
+            break;
+        top[top_count] = busiest;
+        if(busiest < BootstrapSlots){
+            printf("    BS:%0.4X %5.1f%%\n", busiest, 100.0 * busiest_cycles / profiler.total_cycles);
+        } else {
+            printf("       %0.4X %5.1f%%\n", busiest - BootstrapSlots, 100.0 * busiest_cycles / profiler.total_cycles);
+        }
+    }
+
+    profiler.release();
+}
+
+/*
+ Runs `instance_count` headless copies of the cart side by side, a frame at a time each, up to
+ `frame_count`, like a batch of agents would. Every `CountersReportFrames` frames, each
+ instance's counters go to stdout as a JSON line.
+ */
+void run_counters(const char* cart_filename, U32 frame_count, U32 instance_count) {
+    HeadlessEmulator** emus = new HeadlessEmulator*[instance_count];
+    for(U32 instance = 0; instance < instance_count; ++instance){
+        emus[instance] = new HeadlessEmulator;
+        emulator_init(emus[instance]);
+        cart_fread(&emus[instance]->cart, cart_filename);
+    }
+
+    for(U32 frame = 1; frame <= frame_count; ++frame){
+        for(U32 instance = 0; instance < instance_count; ++instance){
+            emulator_run_until_frame(emus[instance], frame);
+        }
+        if(frame % CountersReportFrames == 0 || frame == frame_count){
+            for(U32 instance = 0; instance < instance_count; ++instance){
+                Counters::Snapshot snapshot;
+                emulator_counters(emus[instance], &snapshot);
+                Counters::write_json(stdout, instance, &snapshot);
+            }
+        }
+    }
+
+    for(U32 instance = 0; instance < instance_count; ++instance){
+        delete emus[instance];
+    }
+    delete[] emus;
+}
+
+// prints what each emulated second of busy audio costs, with and without anyone listening
+void benchmark_apu(U32 seconds) {
+    for(int pass = 0; pass < 2; ++pass){
+        BOOL32 output_enabled = (pass == 0);
+        U32 write_count, sample_count;
+        double ms_per_second = time_apu(seconds, output_enabled, &write_count, &sample_count) / seconds;
+        printf("%s: %u emulated seconds, %u register writes, %u samples\n",
+               (output_enabled ? "drained" : "headless"), seconds, write_count, sample_count);
+        printf("    %.3f ms per emulated second (%.3f%% of real time)\n", ms_per_second, ms_per_second / 10.0);
+    }
+}
+
+/*
+ Decodes the same random tile rows `repeat_count` times with `unpack_pixel` a pixel at a
+ time, the portable decoder and the SSE2 one (where it's built), prints each one's pixels
+ per nanosecond, and checks that they all decoded the same. Returns whether they did.
+ */
+BOOL32 benchmark_tile_decode(U32 repeat_count) {
+    const unsigned RowCount = Video::VRAM::TileCount * Video::Tile::PixelSize * 64;
+    const unsigned PixelCount = RowCount * Video::Tile::PixelSize;
+    Video::Tile::Row* rows = new Video::Tile::Row[RowCount];
+    U8* outputs[3] = { new U8[PixelCount], new U8[PixelCount], new U8[PixelCount] };
+    srand(0);
+    for(unsigned row_idx = 0; row_idx < RowCount; ++row_idx){
+        rows[row_idx].b1 = (U8)rand();
+        rows[row_idx].b2 = (U8)rand();
+    }
+
+    const char* names[3] = { "unpack_pixel", "portable", "decode_tile_rows" };
+    for(int method = 0; method < 3; ++method){
+        U8* out = outputs[method];
+        auto start = std::chrono::steady_clock::now();
+        for(U32 repeat = 0; repeat < repeat_count; ++repeat){
+            switch(method){
+                case 0:
+                    for(unsigned row_idx = 0; row_idx < RowCount; ++row_idx){
+                        for(unsigned x = 0; x < Video::Tile::PixelSize; ++x){
+                            out[row_idx * Video::Tile::PixelSize + x] = rows[row_idx].unpack_pixel((Video::Tile::PixelSize - 1) - x);
+                        }
+                    }
+                    break;
+                case 1: Video::decode_tile_rows_portable(rows, RowCount, out); break;
+                case 2: Video::decode_tile_rows(rows, RowCount, out); break;
+            }
+        }
+        double elapsed_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        printf("%-16s %.2f px/ns\n", names[method], (double)PixelCount * repeat_count / elapsed_ns);
+    }
+#if !defined(__SSE2__)
+    printf("    (built without SSE2, so decode_tile_rows is the portable one too)\n");
+#endif
+
+    BOOL32 matched = (memcmp(outputs[0], outputs[1], PixelCount) == 0 && memcmp(outputs[0], outputs[2], PixelCount) == 0);
+    printf("%s\n", matched ? "all matched" : "MISMATCH");
+
+    delete[] rows;
+    for(int method = 0; method < 3; ++method){
+        delete[] outputs[method];
+    }
+    return matched;
+}
+
+// what `SpriteIndex::line` should give, found by checking all 40 sprites
+unsigned scan_sprite_line(const Video::OAM* oam, U8 height, U8 line_idx, U8 out[Video::SpriteIndex::MaxSpritesPerLine]) {
+    unsigned count = 0;
+    for(unsigned sprite_idx = 0; sprite_idx < Video::OAM::SpriteCount && count < Video::SpriteIndex::MaxSpritesPerLine; ++sprite_idx){
+        int top = (int)oam->sprites[sprite_idx].y - Video::SpriteYOffset;
+        if(line_idx >= top && line_idx < top + height){
+            // after every sprite that's further left, or as far left and earlier in OAM
+            unsigned position = count;
+            while(position > 0 && oam->sprites[out[position - 1]].x > oam->sprites[sprite_idx].x){
+                out[position] = out[position - 1];
+                --position;
+            }
+            out[position] = (U8)sprite_idx;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+// an OAM write, as `GPU::apply_write` replays it
+void write_oam(Video::OAM* oam, Video::SpriteIndex* index, U8 offset, U8 value) {
+    U8 sprite_idx = offset / sizeof(Video::Sprite);
+    Video::Sprite old_sprite = oam->sprites[sprite_idx];
+    oam->memory[offset] = value;
+    index->sprite_written(oam, sprite_idx, old_sprite.y, old_sprite.x);
+}
+
+/*
+ Times finding every line's sprites for `frame_count` frames, by scanning all 40 on each line
+ and with `SpriteIndex`. There are 40 sprites in 4 bands of 10, all of OAM is rewritten every
+ frame as a game's DMA would, and the 10 in the top band move every frame.
+ */
+BOOL32 benchmark_sprites(U32 frame_count) {
+    const U8 Height = 8;
+    static Video::OAM scanned_oam;
+    static Video::OAM oam; // for `index`
+    static Video::SpriteIndex index;
+    memset(&scanned_oam, 0, sizeof(scanned_oam));
+    memset(&oam, 0, sizeof(oam));
+    index.rebuild(&oam, Height);
+
+    U8 frame_oam[sizeof(oam.memory)];
+    unsigned mismatches = 0;
+    double elapsed_ns[2] = { 0, 0 };
+    U32 checksum = 0;
+    for(U32 frame = 0; frame < frame_count; ++frame){
+        for(unsigned sprite_idx = 0; sprite_idx < Video::OAM::SpriteCount; ++sprite_idx){
+            unsigned band = sprite_idx / 10;
+            Video::Sprite sprite;
+            sprite.y = (U8)(Video::SpriteYOffset + band * 36);
+            sprite.x = (U8)(Video::SpriteXOffset + (sprite_idx % 10) * 16 + (band == 0 ? frame % 16 : 0));
+            sprite.pattern = (U8)sprite_idx;
+            sprite.flags = 0;
+            memcpy(&frame_oam[sprite_idx * sizeof(sprite)], &sprite, sizeof(sprite));
+        }
+
+        for(int method = 0; method < 2; ++method){
+            auto start = std::chrono::steady_clock::now();
+            for(U8 offset = 0; offset < sizeof(frame_oam); ++offset){
+                if(method == 0){
+                    scanned_oam.memory[offset] = frame_oam[offset];
+                } else {
+                    write_oam(&oam, &index, offset, frame_oam[offset]);
+                }
+            }
+            for(U8 line_idx = 0; line_idx < Video::ViewportHeight; ++line_idx){
+                U8 scanned[Video::SpriteIndex::MaxSpritesPerLine];
+                unsigned count;
+                const U8* list = (method == 0 ? scanned : NULL);
+                if(method == 0){
+                    count = scan_sprite_line(&scanned_oam, Height, line_idx, scanned);
+                } else {
+                    list = index.line(&oam, line_idx, &count);
+                }
+                checksum += count + (count ? list[0] : 0);
+            }
+            elapsed_ns[method] += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        }
+
+        for(U8 line_idx = 0; line_idx < Video::ViewportHeight; ++line_idx){
+            U8 scanned[Video::SpriteIndex::MaxSpritesPerLine];
+            unsigned scanned_count = scan_sprite_line(&oam, Height, line_idx, scanned);
+            unsigned count;
+            const U8* list = index.line(&oam, line_idx, &count);
+            mismatches += (count != scanned_count || memcmp(list, scanned, count) != 0);
+        }
+    }
+
+    printf("%u frames (checksum %u)\n", frame_count, checksum);
+    printf("    scan every line: %.0f ns/frame\n", elapsed_ns[0] / frame_count);
+    printf("    sprite index:    %.0f ns/frame\n", elapsed_ns[1] / frame_count);
+    printf("%s\n", mismatches == 0 ? "all matched" : "MISMATCH");
+    return (mismatches == 0);
+}
+
+/*
+ `gemuboi --self-test`: quick checks of the core that need no cart files, for running after a
+ change. A failed check is reported and counted rather than asserted, so one run shows every
+ failure, with or without NDEBUG.
+ */
+int self_test_failures = 0;
+
+#define SELF_TEST_CHECK(condition) self_test_check((condition), #condition, __LINE__)
+
+void self_test_check(bool passed, const char* description, int line) {
+    if(!passed){
+        printf("    failed at line %d: %s\n", line, description);
+        self_test_failures += 1;
+    }
+}
+
+// a raster write by the first instruction after vblank belongs to the next frame, whether it's rendered on the render thread or not
+void self_test_render_thread_vblank_write() {
+    printf("render thread: SCX written straight after vblank\n");
+    const U8 program[] = {
+        0x3E, 0x01,       // LD A,0x01
+        0xE0, 0xFF,       // LDH (IE),A: only vblank wakes it
+        0xF3,             // DI
+        0x21, 0x43, 0xFF, // LD HL,SCX
+        0x06, 0x00,       // LD B,0x00
+        0xAF,             // loop: XOR A
+        0xE0, 0x0F,       // LDH (IF),A
+        0x76,             // HALT, until vblank starts
+        0x70,             // LD (HL),B
+        0x04,             // INC B
+        0x18, 0xF8,       // JR loop
+    };
+    Cart::Cart* cart = cart_make_test(program, sizeof(program));
+    const U32 FrameCount = 420; // the bootstrap ROM takes most of these
+    SELF_TEST_CHECK(compare_render_thread(cart, FrameCount, False) == 0);
+    delete cart;
+}
+
+// every orientation in the tile cache matches the tile decoded a pixel at a time, whether it was decoded all at once or a row at a time
+void self_test_tile_cache() {
+    printf("tile cache: all four flips, decoded whole and by row\n");
+    static Video::VRAM vram;
+    static Video::TileCache whole;
+    static Video::TileCache by_row;
+    srand(1);
+    for(unsigned i = 0; i < sizeof(vram.memory); ++i){
+        vram.memory[i] = (U8)rand();
+    }
+    whole.decode_all(&vram);
+    for(U16 offset = 0; offset < sizeof(vram.tiles); offset += sizeof(Video::Tile::Row)){
+        by_row.decode_row(&vram, offset + (offset & 1));
+    }
+
+    unsigned mismatches = 0;
+    for(unsigned tile_idx = 0; tile_idx < Video::VRAM::TileCount; ++tile_idx){
+        for(unsigned y = 0; y < Video::Tile::PixelSize; ++y){
+            for(unsigned x = 0; x < Video::Tile::PixelSize; ++x){
+                for(unsigned flip = 0; flip < Video::TileFlipCount; ++flip){
+                    unsigned source_x = (flip & Video::TileFlip_X ? x : (Video::Tile::PixelSize - 1) - x); // bit 7 is the leftmost pixel
+                    unsigned source_y = (flip & Video::TileFlip_Y ? (Video::Tile::PixelSize - 1) - y : y);
+                    U8 expected = vram.tiles[tile_idx].rows[source_y].unpack_pixel(source_x);
+                    mismatches += (whole.row(tile_idx, y, (Video::TileFlip)flip)[x] != expected);
+                    mismatches += (by_row.row(tile_idx, y, (Video::TileFlip)flip)[x] != expected);
+                }
+            }
+        }
+    }
+    SELF_TEST_CHECK(mismatches == 0);
+}
+
+// packing and unpacking are each other's inverse, with or without SSE2, and leave the first pixel in the top bits
+void self_test_pack_2bpp() {
+    printf("2bpp: pack and unpack round trips\n");
+    const unsigned Counts[] = { 4, 28, 32, 36, 64, Video::ViewportWidth, Video::ViewportWidth + 4 };
+    const unsigned MaxCount = Video::ViewportWidth + 4;
+    U8 shades[MaxCount];
+    U8 packed[MaxCount / 4];
+    U8 repacked[MaxCount / 4];
+    U8 unpacked[MaxCount];
+    srand(2);
+    for(unsigned count : Counts){
+        for(unsigned i = 0; i < count; ++i){
+            shades[i] = (U8)(rand() & 0x03);
+        }
+        Video::pack_2bpp(shades, count, packed);
+        unsigned mismatches = 0;
+        for(unsigned i = 0; i < count; ++i){
+            mismatches += (((packed[i / 4] >> (6 - (i % 4) * 2)) & 0x03) != shades[i]);
+        }
+        SELF_TEST_CHECK(mismatches == 0);
+        Video::unpack_2bpp(packed, count, unpacked);
+        SELF_TEST_CHECK(memcmp(unpacked, shades, count) == 0);
+
+        for(unsigned i = 0; i < count / 4; ++i){
+            packed[i] = (U8)rand();
+        }
+        Video::unpack_2bpp(packed, count, unpacked);
+        Video::pack_2bpp(unpacked, count, repacked);
+        SELF_TEST_CHECK(memcmp(repacked, packed, count / 4) == 0);
+    }
+}
+
+// TIMA overflows on the tick after 0xFF, reloads from TMA, and keeps counting from there
+void self_test_timer_overflow() {
+    printf("timer: overflow and reload\n");
+    const U64 Period = 16; // at 262144Hz
+    Timer::Timer timer;
+    memset(&timer, 0, sizeof(timer));
+    timer.write_tac(0, Timer::TACRunningMask | Timer::TACFrequency262144);
+    timer.write_tma(0, 0xF0);
+    timer.write_tima(0, 0xFE);
+    SELF_TEST_CHECK(timer.overflow_deadline() == 2 * Period);
+    SELF_TEST_CHECK(timer.tima(2 * Period - 1) == 0xFF);
+    SELF_TEST_CHECK(timer.tima(2 * Period) == 0xF0);
+
+    // as the overflow event does
+    timer.sync(2 * Period);
+    SELF_TEST_CHECK(timer.overflow_deadline() == 2 * Period + 16 * Period);
+    SELF_TEST_CHECK(timer.tima(2 * Period + 2 * 16 * Period + Period) == 0xF1); // overflowed twice more without a sync
+
+    // writing DIV restarts the counter that TIMA ticks with
+    timer.write_div(2 * Period + 8);
+    SELF_TEST_CHECK(timer.tima(3 * Period + 7) == 0xF0);
+    SELF_TEST_CHECK(timer.tima(3 * Period + 8) == 0xF1);
+
+    // stopped, it holds its value and never overflows
+    timer.write_tac(4 * Period, Timer::TACFrequency262144);
+    SELF_TEST_CHECK(timer.overflow_deadline() == Scheduler::Never);
+    SELF_TEST_CHECK(timer.tima(100 * Period) == 0xF1);
+}
+
+/*
+ EI takes effect after the next instruction, DI straight after it cancels it, HALT wakes on
+ a pending interrupt whether or not IME is set, and only dispatches if it is. The handler
+ records B, and the program records B after each case.
+ */
+void self_test_interrupt_timing() {
+    printf("interrupts: EI, DI and HALT timing\n");
+    const U8 program[] = {
+        0xF3,             // DI
+        0x31, 0xFE, 0xDF, // LD SP,0xDFFE
+        0x21, 0x00, 0xC0, // LD HL,0xC000
+        0x3E, 0x04,       // LD A,0x04
+        0xE0, 0xFF,       // LDH (IE),A: only the timer
+
+        0x06, 0x00,       // LD B,0x00
+        0xE0, 0x0F,       // LDH (IF),A: timer pending
+        0xFB,             // EI
+        0x04,             // INC B: still runs before the interrupt
+        0x04,             // INC B
+
+        0x06, 0x10,       // LD B,0x10
+        0x3E, 0x04,       // LD A,0x04
+        0xE0, 0x0F,       // LDH (IF),A
+        0xFB,             // EI
+        0xF3,             // DI: so it's never taken
+        0x04,             // INC B
+        0x78,             // LD A,B
+        0x22,             // LD (HL+),A
+
+        0xAF,             // XOR A
+        0xE0, 0x0F,       // LDH (IF),A
+        0x3E, 0xF0,       // LD A,0xF0
+        0xE0, 0x05,       // LDH (TIMA),A
+        0x3E, 0x05,       // LD A,0x05
+        0xE0, 0x07,       // LDH (TAC),A: 16 ticks of 16 cycles to overflow
+        0x06, 0x20,       // LD B,0x20
+        0x76,             // HALT: wakes, but IME is off
+        0x04,             // INC B
+        0x78,             // LD A,B
+        0x22,             // LD (HL+),A
+        0xF0, 0x0F,       // LDH A,(IF)
+        0xE6, 0x1F,       // AND 0x1F
+        0x22,             // LD (HL+),A
+
+        0xAF,             // XOR A
+        0xE0, 0x0F,       // LDH (IF),A
+        0x3E, 0xF0,       // LD A,0xF0
+        0xE0, 0x05,       // LDH (TIMA),A
+        0x06, 0x30,       // LD B,0x30
+        0xFB,             // EI
+        0x76,             // HALT: wakes, dispatches, and returns to after it
+        0x04,             // INC B
+        0x78,             // LD A,B
+        0x22,             // LD (HL+),A
+        0x18, 0xFE,       // JR -2
+    };
+    const U8 handler[] = {
+        0x78,             // LD A,B
+        0x22,             // LD (HL+),A
+        0xC9,             // RET, leaving IME off
+    };
+    Cart::Cart* cart = cart_make_test(program, sizeof(program));
+    memcpy(&cart->data[Interrupts::VectorAddresses[2]], handler, sizeof(handler));
+
+    HeadlessEmulator* emu = new HeadlessEmulator;
+    emulator_init(emu);
+    memcpy(&emu->cart, cart, sizeof(*cart));
+    emulator_run_until_frame(emu, 400); // well past the bootstrap ROM
+
+    const U8 expected[] = {
+        0x01, // the handler ran after one INC B
+        0x11, // never taken
+        0x21, // woke from HALT without the handler
+        Interrupts::Timer, // and left it pending
+        0x30, // the handler ran straight from HALT
+        0x31, // then returned to after it
+    };
+    SELF_TEST_CHECK(memcmp(emu->internal_ram, expected, sizeof(expected)) == 0);
+
+    delete emu;
+    delete cart;
+}
+
+// the sprite index gives the same lines as scanning all 40 sprites, through random OAM writes and height changes
+void self_test_sprite_index() {
+    printf("sprite index: the same as a full scan\n");
+    static Video::OAM oam;
+    static Video::SpriteIndex index;
+
+    // more than 10 on a line: the first 10 in OAM, ordered by X, then by OAM
+    const U8 xs[] = { 50, 20, 20, 90, 10, 60, 20, 30, 40, 70, 5, 1 };
+    memset(&oam, 0, sizeof(oam));
+    for(U8 sprite_idx = 0; sprite_idx < sizeof(xs); ++sprite_idx){
+        oam.sprites[sprite_idx].y = Video::SpriteYOffset;
+        oam.sprites[sprite_idx].x = xs[sprite_idx];
+    }
+    index.rebuild(&oam, 8);
+    const U8 expected[] = { 4, 1, 2, 6, 7, 8, 0, 5, 9, 3 };
+    unsigned count;
+    const U8* list = index.line(&oam, 0, &count);
+    SELF_TEST_CHECK(count == sizeof(expected) && memcmp(list, expected, sizeof(expected)) == 0);
+    SELF_TEST_CHECK(index.line(&oam, 8, &count) && count == 0);
+
+    srand(3);
+    U8 height = 8;
+    unsigned mismatches = 0;
+    for(U32 write = 0; write < 20000; ++write){
+        U8 offset = (U8)(rand() % sizeof(oam.memory));
+        // mostly on screen, so lines fill up
+        U8 value = (offset % sizeof(Video::Sprite) == 0 ? (U8)(rand() % (Video::ViewportHeight + Video::SpriteYOffset + 8)) : (U8)rand());
+        write_oam(&oam, &index, offset, value);
+
+        if(write % 5000 == 4999){
+            height = (height == 8 ? 16 : 8);
+            index.rebuild(&oam, height); // as an LCDC write does
+        }
+        if(write % 50 == 0){
+            for(U8 line_idx = 0; line_idx < Video::ViewportHeight; ++line_idx){
+                U8 scanned[Video::SpriteIndex::MaxSpritesPerLine];
+                unsigned scanned_count = scan_sprite_line(&oam, height, line_idx, scanned);
+                list = index.line(&oam, line_idx, &count);
+                mismatches += (count != scanned_count || memcmp(list, scanned, count) != 0);
+            }
+        }
+    }
+    SELF_TEST_CHECK(mismatches == 0);
+}
+
+// a read watchpoint stops on operands that are read, but not on the bytes after a shorter instruction
+void self_test_read_watchpoint() {
+    printf("watchpoints: only operands are read\n");
+    const U8 program[] = {
+        0x00,       // 0x0150: NOP
+        0x00,       // 0x0151: NOP
+        0x00,       // 0x0152: NOP
+        0x18, 0xFD, // 0x0153: JR 0x0152
+    };
+    Cart::Cart* cart = cart_make_test(program, sizeof(program));
+    const U32 FrameCount = 400; // well past the bootstrap ROM
+
+    const U16 addresses[] = { 0x0152, 0x0154 };
+    const BOOL32 expected[] = { False, True };
+    for(int i = 0; i < 2; ++i){
+        Emulator* emu = new Emulator;
+        emulator_init(emu);
+        memcpy(&emu->cart, cart, sizeof(*cart));
+        emulator_set_watchpoint(emu, addresses[i], Debugger::Watch_Read, True);
+        emulator_run_until_frame(emu, FrameCount);
+        SELF_TEST_CHECK(emu->debugger.stopped == expected[i]);
+        if(expected[i]){
+            SELF_TEST_CHECK(emu->debugger.hit_address == addresses[i]);
+        }
+        delete emu;
+    }
+    delete cart;
+}
+
+// sampling attributes whole periods, however they line up with instructions
+void self_test_profiler_sampling() {
+    printf("profiler: periods shorter than an instruction\n");
+    Profiler::Profiler profiler;
+    profiler.init(10);
+    profiler.add_cycles(0x0150, 0, 3);
+    SELF_TEST_CHECK(profiler.total_cycles == 0 && profiler.cycles_until_sample == 7);
+    profiler.add_cycles(0x0151, 0, 24); // ends two periods
+    SELF_TEST_CHECK(profiler.total_cycles == 20 && profiler.cycles_until_sample == 3);
+    SELF_TEST_CHECK(profiler.pc_cycles[0x0151] == 20);
+    profiler.add_cycles(0x0152, 0, 3); // ends one exactly
+    SELF_TEST_CHECK(profiler.total_cycles == 30 && profiler.cycles_until_sample == 10);
+    profiler.release();
+
+    profiler.init(1);
+    profiler.add_cycles(0x0150, 0, 24);
+    SELF_TEST_CHECK(profiler.total_cycles == 24 && profiler.cycles_until_sample == 1);
+    profiler.release();
+}
+
+enum LinkSchedule {
+    Link_AThenB, // a frame of one, then a frame of the other
+    Link_BThenA,
+    Link_Threads, // each on its own thread, as fast as they'll go
+    Link_AAlone, // a on its own until it has to wait, then as `Link_AThenB`
+    LinkScheduleCount,
+};
+
+/*
+ Runs `carts[0]` and `carts[1]` linked together up to `frame_count` and returns both
+ emulators, for the caller to delete. However they're scheduled on the host, they should
+ end up the same.
+ */
+void run_linked(Cart::Cart* const carts[2], U32 frame_count, LinkSchedule schedule, HeadlessEmulator* out_emus[2]) {
+    static Serial::LinkCable cables[LinkScheduleCount];
+    Serial::LinkCable* cable = &cables[schedule];
+
+    HeadlessEmulator* emus[2] = { new HeadlessEmulator, new HeadlessEmulator };
+    for(int i = 0; i < 2; ++i){
+        srand(0);
+        emulator_init(emus[i]);
+        memcpy(&emus[i]->cart, carts[i], sizeof(*carts[i]));
+    }
+    emulator_connect_link(emus[0], emus[1], cable);
+
+    if(schedule == Link_Threads){
+        auto run = [frame_count](HeadlessEmulator* emu){
+            while(emu->gpu.frame_number < frame_count){
+                emulator_run_until_frame(emu, frame_count);
+                if(emu->interrupts.link_waiting){
+                    std::this_thread::yield();
+                }
+            }
+        };
+        std::thread thread(run, emus[1]);
+        run(emus[0]);
+        thread.join();
+    } else {
+        if(schedule == Link_AAlone){
+            emulator_run_until_frame(emus[0], frame_count);
+            SELF_TEST_CHECK(emus[0]->interrupts.link_waiting);
+            U64 waiting_cycle = emus[0]->scheduler.cycles;
+            emulator_run_until_frame(emus[0], frame_count);
+            SELF_TEST_CHECK(emus[0]->scheduler.cycles == waiting_cycle); // still waiting, without time passing
+        }
+
+        HeadlessEmulator* first = emus[schedule == Link_BThenA ? 1 : 0];
+        HeadlessEmulator* second = emus[schedule == Link_BThenA ? 0 : 1];
+        while(first->gpu.frame_number < frame_count || second->gpu.frame_number < frame_count){
+            emulator_run_until_frame(first, std::min(first->gpu.frame_number + 1, frame_count));
+            emulator_run_until_frame(second, std::min(second->gpu.frame_number + 1, frame_count));
+        }
+    }
+
+    out_emus[0] = emus[0];
+    out_emus[1] = emus[1];
+}
+
+/*
+ Two carts send each other bytes, one driving the clock and the other listening with a
+ delay that varies. Both keep what they received, and how long they polled SC for, so any
+ difference in timing shows up in RAM. The one driving first writes SC more times than the
+ cable can hold, so it has to wait when it runs on its own.
+ */
+void self_test_link_cable() {
+    printf("link cable: the same in every schedule\n");
+    const U8 internal_program[] = {
+        0xF3,             // DI
+        0x06, 0x80,       // LD B,0x80
+        0x3E, 0x01,       // LD A,0x01
+        0xE0, 0x02,       // idle: LDH (SC),A: more writes than the cable holds, none of them starting a transfer
+        0x05,             // DEC B
+        0x20, 0xFB,       // JR NZ,idle
+        0x21, 0x00, 0xC0, // LD HL,0xC000
+        0x06, 0x01,       // LD B,0x01
+        0x78,             // loop: LD A,B
+        0xE0, 0x01,       // LDH (SB),A
+        0x3E, 0x81,       // LD A,0x81
+        0xE0, 0x02,       // LDH (SC),A: start, with the internal clock
+        0x0E, 0x00,       // LD C,0x00
+        0x0C,             // poll: INC C
+        0xF0, 0x02,       // LDH A,(SC)
+        0x87,             // ADD A,A
+        0x38, 0xFA,       // JR C,poll
+        0xF0, 0x01,       // LDH A,(SB)
+        0x22,             // LD (HL+),A
+        0x79,             // LD A,C
+        0x22,             // LD (HL+),A
+        0x04,             // INC B
+        0x7C,             // LD A,H
+        0xFE, 0xC1,       // CP 0xC1
+        0x20, 0xE6,       // JR NZ,loop
+        0x18, 0xFE,       // JR -2
+    };
+    const U8 external_program[] = {
+        0xF3,             // DI
+        0x21, 0x00, 0xC0, // LD HL,0xC000
+        0x06, 0x80,       // LD B,0x80
+        0x78,             // loop: LD A,B
+        0xE0, 0x01,       // LDH (SB),A
+        0x50,             // LD D,B
+        0x15,             // delay: DEC D
+        0x20, 0xFD,       // JR NZ,delay
+        0x3E, 0x80,       // LD A,0x80
+        0xE0, 0x02,       // LDH (SC),A: start, with the external clock
+        0x0E, 0x00,       // LD C,0x00
+        0x0C,             // poll: INC C
+        0xF0, 0x02,       // LDH A,(SC)
+        0x87,             // ADD A,A
+        0x38, 0xFA,       // JR C,poll
+        0xF0, 0x01,       // LDH A,(SB)
+        0x22,             // LD (HL+),A
+        0x79,             // LD A,C
+        0x22,             // LD (HL+),A
+        0x04,             // INC B
+        0x7C,             // LD A,H
+        0xFE, 0xC1,       // CP 0xC1
+        0x20, 0xE2,       // JR NZ,loop
+        0x18, 0xFE,       // JR -2
+    };
+    Cart::Cart* carts[2] = {
+        cart_make_test(internal_program, sizeof(internal_program)),
+        cart_make_test(external_program, sizeof(external_program)),
+    };
+    const U32 FrameCount = 400;
+
+    HeadlessEmulator* expected[2];
+    run_linked(carts, FrameCount, Link_AThenB, expected);
+    SELF_TEST_CHECK(expected[0]->serial.bytes_transferred > 10);
+    SELF_TEST_CHECK(expected[1]->serial.bytes_transferred > 10);
+    SELF_TEST_CHECK(expected[0]->internal_ram[1] != 0xFF || expected[0]->internal_ram[3] != 0xFF); // some reached the other side
+
+    const LinkSchedule others[] = { Link_BThenA, Link_Threads, Link_AAlone };
+    for(LinkSchedule schedule : others){
+        HeadlessEmulator* emus[2];
+        run_linked(carts, FrameCount, schedule, emus);
+        for(int i = 0; i < 2; ++i){
+            SELF_TEST_CHECK(memcmp(emus[i]->internal_ram, expected[i]->internal_ram, sizeof(emus[i]->internal_ram)) == 0);
+            SELF_TEST_CHECK(emus[i]->registers.pc == expected[i]->registers.pc);
+            SELF_TEST_CHECK(emus[i]->scheduler.cycles == expected[i]->scheduler.cycles);
+            SELF_TEST_CHECK(emus[i]->serial.bytes_transferred == expected[i]->serial.bytes_transferred);
+            delete emus[i];
+        }
+    }
+
+    for(int i = 0; i < 2; ++i){
+        delete expected[i];
+        delete carts[i];
+    }
+}
+
+int run_self_test() {
+    self_test_render_thread_vblank_write();
+    self_test_tile_cache();
+    self_test_pack_2bpp();
+    self_test_sprite_index();
+    self_test_timer_overflow();
+    self_test_interrupt_timing();
+    self_test_read_watchpoint();
+    self_test_profiler_sampling();
+    self_test_link_cable();
+
+    printf("%d failed\n", self_test_failures);
+    return (self_test_failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
 int main(int argc, const char * argv[]) {
     assert(argc >= 2);
 
+    // gemuboi --self-test
+    if(strcmp(argv[1], "--self-test") == 0){
+        return run_self_test();
+    }
+
+    // gemuboi --bench-apu [seconds]
+    if(strcmp(argv[1], "--bench-apu") == 0){
+        benchmark_apu(argc >= 3 ? (U32)atoi(argv[2]) : 60);
+        return EXIT_SUCCESS;
+    }
+
+    // gemuboi --bench-tile-decode [repeats]
+    if(strcmp(argv[1], "--bench-tile-decode") == 0){
+        BOOL32 matched = benchmark_tile_decode(argc >= 3 ? (U32)atoi(argv[2]) : 20);
+        return (matched ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // gemuboi --bench-sprites [frames]
+    if(strcmp(argv[1], "--bench-sprites") == 0){
+        BOOL32 matched = benchmark_sprites(argc >= 3 ? (U32)atoi(argv[2]) : 100000);
+        return (matched ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // gemuboi <cart> --compare-render-thread <frames>
+    if(argc >= 4 && strcmp(argv[2], "--compare-render-thread") == 0){
+        Cart::Cart* cart = new Cart::Cart();
+        cart_fread(cart, argv[1]);
+        int mismatches = compare_render_thread(cart, (U32)atoi(argv[3]), True);
+        delete cart;
+        printf("%d mismatched frames\n", mismatches);
+        return (mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // gemuboi <cart> --bench-configs [frames]
+    if(argc >= 3 && strcmp(argv[2], "--bench-configs") == 0){
+        benchmark_configs(argv[1], argc >= 4 ? (U32)atoi(argv[3]) : 3600);
+        return EXIT_SUCCESS;
+    }
+
+    // gemuboi <cart> --bench-trace [frames] [trace file]
+    if(argc >= 3 && strcmp(argv[2], "--bench-trace") == 0){
+        benchmark_trace(argv[1], argc >= 4 ? (U32)atoi(argv[3]) : 3600, argc >= 5 ? argv[4] : NULL);
+        return EXIT_SUCCESS;
+    }
+
+    // gemuboi <cart> --profile-run <frames> <folded stacks file> [sample period in cycles]
+    if(argc >= 5 && strcmp(argv[2], "--profile-run") == 0){
+        U32 sample_period = 0;
+        if(argc >= 6){
+            char* end = NULL;
+            long period = strtol(argv[5], &end, 10);
+            if(*end != '\0' || period < 0 || period > 0x7FFFFFFF){
+                fprintf(stderr, "bad sample period: %s\n", argv[5]);
+                return EXIT_FAILURE;
+            }
+            sample_period = (U32)period;
+        }
+        run_profile(argv[1], (U32)atoi(argv[3]), argv[4], sample_period);
+        return EXIT_SUCCESS;
+    }
+
+    // gemuboi <cart> --counters-run <frames> [instances]
+    if(argc >= 4 && strcmp(argv[2], "--counters-run") == 0){
+        run_counters(argv[1], (U32)atoi(argv[3]), argc >= 5 ? (U32)atoi(argv[4]) : 1);
+        return EXIT_SUCCESS;
+    }
+
+    // gemuboi <cart> --serial-test [max frames]
+    if(argc >= 3 && strcmp(argv[2], "--serial-test") == 0){
+        U32 max_frames = (argc >= 4 ? (U32)atoi(argv[3]) : 60 * 60);
+        return run_serial_test(argv[1], max_frames);
+    }
+
     int init_result = SDL_Init(SDL_INIT_VIDEO);
     assert(init_result == 0);
     atexit(SDL_Quit);
@@ -172,13 +1494,47 @@ int main(int argc, const char * argv[]) {
                                           SDL_WINDOW_SHOWN);
     assert(window);
 
-    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, 0);
+    // emulation runs on its own thread, so blocking on vsync here doesn't slow it down
+    SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_PRESENTVSYNC);
     assert(renderer);
 
     Emulator* emu = new Emulator;
     emulator_init(emu);
     cart_fread(&emu->cart, argv[1]);
 
+    // gemuboi <cart> [--break <address>]... [--watch <address>]... [--trace <file>] [--profile <file>] [--counters <file>]
+    // addresses are in hex, e.g. --break 006A stops in the boot ROM just after it waits for vblank.
+    // The trace keeps the last `Trace::DefaultCapacity` instructions, see gemuboi-trace. The
+    // profile is written as folded stacks when the window is closed. The counters are written
+    // as JSON lines once a second, as well as going in the window title
+    Trace::Ring trace;
+    Profiler::Profiler profiler;
+    const char* profile_filename = NULL;
+    FILE* counters_file = NULL;
+    for(int arg_idx = 2; arg_idx + 1 < argc; arg_idx += 2){
+        U16 address = (U16)strtoul(argv[arg_idx + 1], NULL, 16);
+        if(strcmp(argv[arg_idx], "--break") == 0){
+            emulator_set_breakpoint(emu, address, True);
+        } else if(strcmp(argv[arg_idx], "--watch") == 0){
+            emulator_set_watchpoint(emu, address, Debugger::Watch_Read | Debugger::Watch_Write, True);
+        } else if(strcmp(argv[arg_idx], "--trace") == 0){
+            if(trace.open(Trace::DefaultCapacity, argv[arg_idx + 1])){
+                emu->trace = &trace;
+            } else {
+                printf("Couldn't open trace file: %s\n", argv[arg_idx + 1]);
+            }
+        } else if(strcmp(argv[arg_idx], "--profile") == 0){
+            profile_filename = argv[arg_idx + 1];
+            profiler.init(0);
+            emu->profiler = &profiler;
+        } else if(strcmp(argv[arg_idx], "--counters") == 0){
+            counters_file = fopen(argv[arg_idx + 1], "w");
+            if(!counters_file){
+                printf("Couldn't open counters file: %s\n", argv[arg_idx + 1]);
+            }
+        }
+    }
+
     test(emu);
 
     SDL_Texture* vram_window = SDL_CreateTexture(renderer,
@@ -198,10 +1554,41 @@ int main(int argc, const char * argv[]) {
                                                    SDL_TEXTUREACCESS_STREAMING,
                                                    Video::ViewportWidth, Video::ViewportHeight);
 
+    U32 palette[4];
+    make_host_palette(Video::HostPixelFormat_ARGB8888, palette);
+
+    static Frontend shared; // too big for the stack, and needs its alignment respected
+    Frontend* frontend = &shared;
+    frontend->emu = emu;
+    frontend->show_debug_views = true; // the tileset/window/background panel
+    frontend->counters_file = counters_file;
+
+    // no audio isn't fatal, emulation just gets paced by the system clock instead
+    SDL_AudioDeviceID audio_device = 0;
+    if(SDL_InitSubSystem(SDL_INIT_AUDIO) == 0){
+        SDL_AudioSpec spec;
+        SDL_zero(spec);
+        spec.freq = Audio::DefaultSampleRate;
+        spec.format = AUDIO_S16SYS;
+        spec.channels = 2;
+        spec.samples = AudioCallbackSamples;
+        spec.callback = audio_callback;
+        spec.userdata = frontend;
+        audio_device = SDL_OpenAudioDevice(NULL, 0, &spec, NULL, 0); // SDL converts if it has to
+    }
+    if(audio_device == 0){
+        printf("No audio: %s\n", SDL_GetError());
+    }
+    frontend->audio_enabled = (audio_device != 0);
+
+    std::thread emulation(emulation_thread, frontend);
+    if(audio_device){
+        SDL_PauseAudioDevice(audio_device, 0);
+    }
 
     bool running = true;
-    bool continuing = true;
-    U32 last_frame = UINT32_MAX;
+    U32 debug_views_version = 0; // `vram_version` that the debug textures were last updated from
+    char title[sizeof(((Frame*)0)->status)] = "";
     while(running){
         SDL_Event event;
         while(SDL_PollEvent(&event)){
@@ -209,60 +1596,90 @@ int main(int argc, const char * argv[]) {
                 case SDL_QUIT: running = false; break;
                 case SDL_KEYDOWN:
                     switch(event.key.keysym.sym){
-                        case SDLK_s:
-                            emulator_step(emu);
-                            print_next_instruction(emu);
-                            break;
-                        case SDLK_n: for(int i=0;i<100;++i) emulator_step(emu); break;
-                        case SDLK_r: print_register_info(emu); break;
-                        case SDLK_c: continuing = true; break;
-                        case SDLK_b: continuing = false; break;
-                        case SDLK_LEFT: move_window(emu, -1, 0); break;
-                        case SDLK_RIGHT: move_window(emu, 1, 0); break;
-                        case SDLK_UP: move_window(emu, 0, -1); break;
-                        case SDLK_DOWN: move_window(emu, 0, 1); break;
+                        case SDLK_s: send_command(frontend, Command_Step); break;
+                        case SDLK_n: send_command(frontend, Command_Step100); break;
+                        case SDLK_r: send_command(frontend, Command_PrintRegisters); break;
+                        case SDLK_c: send_command(frontend, Command_Continue); break;
+                        case SDLK_b: send_command(frontend, Command_Break); break;
+                        case SDLK_d: frontend->show_debug_views = !frontend->show_debug_views; break;
+                        case SDLK_LEFT: send_command(frontend, Command_MoveWindow, -1, 0); break;
+                        case SDLK_RIGHT: send_command(frontend, Command_MoveWindow, 1, 0); break;
+                        case SDLK_UP: send_command(frontend, Command_MoveWindow, 0, -1); break;
+                        case SDLK_DOWN: send_command(frontend, Command_MoveWindow, 0, 1); break;
                         default: break; //do nothing
                     }
                     break;
             }
         }
 
-        if(continuing){
-            emulator_step(emu);
-        } else {
-            SDL_Delay(1); //don't check up the CPU too badly
+        if(!frontend->frames.update_front()){
+            SDL_Delay(1); //nothing new to show
+            continue;
         }
 
-        if(continuing && emu->registers.pc == BREAKPOINT){
-            printf("Breaking at %0.4X\n", BREAKPOINT);
-            continuing = false;
+        const Frame* frame = frontend->frames.front_buffer();
+        U64 start_ns = Counters::now_ns();
+
+        if(frame->status[0] && strcmp(title, frame->status) != 0){
+            strcpy(title, frame->status);
+            SDL_SetWindowTitle(window, title);
         }
 
-        if(last_frame != emu->gpu.frame_number){
-            last_frame = emu->gpu.frame_number;
+        SDL_Rect tileset_rect = { 0, 0, Video::Tileset_PixelsPerRow * 2, Video::Tileset_PixelsPerColumn * 2 };
+        SDL_Rect window_rect = {tileset_rect.w + 5, 0, Video::ScreenBufferSize, Video::ScreenBufferSize};
+        SDL_Rect background_rect = {window_rect.x, window_rect.h + 5, Video::ScreenBufferSize, Video::ScreenBufferSize};
+        SDL_Rect viewport_rect = { window_rect.x + window_rect.w + 5, 0, Video::ViewportWidth*2, Video::ViewportHeight*2 };
 
-            SDL_Rect tileset_rect = { 0, 0, Video::Tileset_PixelsPerRow * 2, Video::Tileset_PixelsPerColumn * 2 };
-            SDL_Rect window_rect = {tileset_rect.w + 5, 0, Video::ScreenBufferSize, Video::ScreenBufferSize};
-            SDL_Rect background_rect = {window_rect.x, window_rect.h + 5, Video::ScreenBufferSize, Video::ScreenBufferSize};
-            SDL_Rect viewport_rect = { window_rect.x + window_rect.w + 5, 0, Video::ViewportWidth*2, Video::ViewportHeight*2 };
+        update_texture(vram_viewport, &frame->viewport[0][0], Video::ViewportWidth, Video::ViewportHeight);
 
-            update_texture(vram_tileset, &emu->gpu.tileset);
-            update_texture(vram_window, &emu->gpu.window);
-            update_texture(vram_background, &emu->gpu.background);
-            update_texture(vram_viewport, &emu->gpu.viewport);
+        SDL_SetRenderDrawColor(renderer, 0, 0x33, 0, 0xFF);
+        SDL_RenderClear(renderer);
 
-            SDL_SetRenderDrawColor(renderer, 0, 0x33, 0, 0xFF);
-            SDL_RenderClear(renderer);
+        if(frame->has_debug_views){
+            if(debug_views_version != frame->vram_version){
+                debug_views_version = frame->vram_version;
+                update_texture(vram_tileset, &frame->tileset[0][0], Video::Tileset_PixelsPerRow, Video::Tileset_PixelsPerColumn, palette);
+                update_texture(vram_window, &frame->window[0][0], Video::ScreenBufferSize, Video::ScreenBufferSize, palette);
+                update_texture(vram_background, &frame->background[0][0], Video::ScreenBufferSize, Video::ScreenBufferSize, palette);
+            }
             SDL_RenderCopy(renderer, vram_tileset, NULL, &tileset_rect);
             SDL_RenderCopy(renderer, vram_window, NULL, &window_rect);
             SDL_RenderCopy(renderer, vram_background, NULL, &background_rect);
-            SDL_RenderCopy(renderer, vram_viewport, NULL, &viewport_rect);
-            SDL_RenderPresent(renderer);
         }
+        SDL_RenderCopy(renderer, vram_viewport, NULL, &viewport_rect);
+        frontend->presentation_ns.fetch_add(Counters::now_ns() - start_ns, std::memory_order_relaxed);
+        SDL_RenderPresent(renderer); // waits for vsync, so isn't counted
+    }
+
+    send_command(frontend, Command_Quit);
+    emulation.join();
+
+    if(emu->trace){
+        emu->trace = NULL;
+        trace.close();
+    }
+
+    if(emu->profiler){
+        emu->profiler = NULL;
+        FILE* f = fopen(profile_filename, "w");
+        if(f){
+            profiler.write_folded(f);
+            fclose(f);
+        }
+        profiler.release();
+    }
+
+    if(counters_file){
+        fclose(counters_file);
+    }
+
+    if(audio_device){
+        SDL_CloseAudioDevice(audio_device);
+        printf("Audio: %u underruns, %u samples dropped\n",
+               frontend->audio_underruns.load(), frontend->audio_overruns.load());
     }
 
     SDL_DestroyRenderer(renderer);
 
     return EXIT_SUCCESS;
 }
-
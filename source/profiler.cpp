@@ -0,0 +1,134 @@
+//
+//  profiler.cpp
+//  gemuboi
+//
+
+#include "profiler.hpp"
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+
+void Profiler::Profiler::init(U32 sample_period) {
+    nodes = (Node*)calloc(MaxNodes, sizeof(Node));
+    pc_cycles = (U64*)calloc(0x10000, sizeof(U64));
+    bootstrap_cycles = (U64*)calloc(0x100, sizeof(U64));
+    assert(nodes && pc_cycles && bootstrap_cycles);
+
+    Node* root = &nodes[RootNode];
+    root->address = 0x0000;
+    root->bank = Cart::BootstrapBank;
+    root->parent = NoNode;
+    root->first_child = NoNode;
+    root->next_sibling = NoNode;
+    node_count = 1;
+    nodes_dropped = 0;
+
+    frames[0].node = RootNode;
+    frames[0].return_address = 0;
+    depth = 0;
+
+    this->sample_period = sample_period;
+    cycles_until_sample = sample_period;
+    total_cycles = 0;
+}
+
+void Profiler::Profiler::release() {
+    free(nodes);
+    free(pc_cycles);
+    free(bootstrap_cycles);
+    nodes = NULL;
+    pc_cycles = NULL;
+    bootstrap_cycles = NULL;
+}
+
+void Profiler::Profiler::call(U16 target, U8 bank, U16 return_address, BOOL32 interrupt) {
+    if(depth + 1 == MaxDepth){
+        nodes_dropped += 1; // runaway recursion. Stays attributed to the deepest frame
+        return;
+    }
+
+    U32 parent_idx = frames[depth].node;
+    U32 child_idx = nodes[parent_idx].first_child;
+    while(child_idx != NoNode){
+        const Node* child = &nodes[child_idx];
+        if(child->address == target && child->bank == bank && child->interrupt == interrupt)
+            break;
+        child_idx = child->next_sibling;
+    }
+
+    if(child_idx == NoNode){
+        if(node_count == MaxNodes){
+            nodes_dropped += 1;
+            child_idx = parent_idx;
+        } else {
+            child_idx = node_count++;
+            Node* child = &nodes[child_idx];
+            child->address = target;
+            child->bank = bank;
+            child->interrupt = interrupt;
+            child->parent = parent_idx;
+            child->first_child = NoNode;
+            child->next_sibling = nodes[parent_idx].first_child;
+            child->self_cycles = 0;
+            nodes[parent_idx].first_child = child_idx;
+        }
+    }
+
+    depth += 1;
+    frames[depth].node = child_idx;
+    frames[depth].return_address = return_address;
+}
+
+void Profiler::Profiler::ret(U16 return_address) {
+    for(U32 frame_idx = depth; frame_idx > 0; --frame_idx){
+        if(frames[frame_idx].return_address == return_address){
+            depth = frame_idx - 1;
+            return;
+        }
+    }
+}
+
+static int format_frame(char* out, const Profiler::Node* node) {
+    char bank[3];
+    if(node->bank == Cart::BootstrapBank){
+        strcpy(bank, "BS");
+    } else {
+        snprintf(bank, sizeof(bank), "%0.2X", (unsigned)node->bank);
+    }
+    return sprintf(out, "%s%s:%0.4X", (node->interrupt ? "int " : ""), bank, (unsigned)node->address);
+}
+
+void Profiler::Profiler::write_folded_node(FILE* f, U32 node_idx, char* path, U32 path_length) const {
+    const Node* node = &nodes[node_idx];
+    if(path_length > 0){
+        path[path_length++] = ';';
+    }
+    path_length += format_frame(&path[path_length], node);
+
+    if(node->self_cycles){
+        fprintf(f, "%.*s %llu\n", (int)path_length, path, (unsigned long long)node->self_cycles);
+    }
+
+    for(U32 child_idx = node->first_child; child_idx != NoNode; child_idx = nodes[child_idx].next_sibling){
+        write_folded_node(f, child_idx, path, path_length);
+    }
+}
+
+void Profiler::Profiler::write_folded(FILE* f) const {
+    // a path is at most one frame per depth, and each frame is at most "int BS:0000;"
+    static char path[MaxDepth * 16];
+    write_folded_node(f, RootNode, path, 0);
+}
+
+void Profiler::Profiler::write_pc_cycles(FILE* f) const {
+    for(U32 pc = 0; pc < 0x100; ++pc){
+        if(bootstrap_cycles[pc]){
+            fprintf(f, "BS:%0.4X %llu\n", pc, (unsigned long long)bootstrap_cycles[pc]);
+        }
+    }
+    for(U32 pc = 0; pc < 0x10000; ++pc){
+        if(pc_cycles[pc]){
+            fprintf(f, "%0.2X:%0.4X %llu\n", (pc >= 0x4000 && pc <= 0x7FFF ? 1 : 0), pc, (unsigned long long)pc_cycles[pc]);
+        }
+    }
+}
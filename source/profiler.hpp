@@ -0,0 +1,122 @@
+//
+//  profiler.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <stdio.h>
+#include "types.hpp"
+#include "cart.hpp"
+
+namespace Profiler {
+    const U32 MaxNodes = 1 << 16;
+    const U32 MaxDepth = 256;
+    const U32 RootNode = 0;
+    const U32 NoNode = ~0U;
+
+    enum Flow {
+        Flow_None,
+        Flow_Call, // CALL, RST
+        Flow_ConditionalCall, // CALL cc, only if it was taken
+        Flow_Return, // RET, RETI
+        Flow_ConditionalReturn, // RET cc, only if it was taken
+    };
+
+    inline Flow flow(U8 opcode) {
+        switch(opcode){
+            case 0xCD:
+            case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF:
+                return Flow_Call;
+            case 0xC4: case 0xCC: case 0xD4: case 0xDC:
+                return Flow_ConditionalCall;
+            case 0xC9: case 0xD9:
+                return Flow_Return;
+            case 0xC0: case 0xC8: case 0xD0: case 0xD8:
+                return Flow_ConditionalReturn;
+        }
+        return Flow_None;
+    }
+
+    /*
+     A subroutine, reached through a particular chain of calls. The root is whatever was
+     running at power on (the bootstrap ROM), and each call or interrupt from a node goes to a
+     child of it, so `self_cycles` summed along each path is a folded stack.
+     */
+    struct Node {
+        U16 address; // the entry point
+        U8 bank; // or `Cart::BootstrapBank`
+        BOOL32 interrupt; // entered by dispatching an interrupt, rather than a call
+        U32 parent;
+        U32 first_child;
+        U32 next_sibling;
+        U64 self_cycles;
+    };
+
+    struct Frame {
+        U32 node;
+        U16 return_address;
+    };
+
+    /*
+     Attributes emulated cycles to the PC (and bank) they were spent at, and to the current
+     node of a call tree kept from the calls, returns and interrupts the CPU goes through.
+
+     Returns are matched against the return addresses on the shadow stack, so code that
+     fiddles with the real stack (pops a return address, or jumps back instead of returning)
+     doesn't leave it permanently out of step: a return that doesn't match the top frame
+     unwinds to the nearest frame that does match, and is ignored if none do.
+
+     With a `sample_period`, cycles are only attributed once every that many cycles, in one
+     lump, to wherever the CPU is at the time. A period shorter than an instruction just
+     takes several samples of it. The call tree is still kept exactly.
+     */
+    struct Profiler {
+        Node* nodes;
+        U32 node_count;
+        U32 nodes_dropped; // calls that found no free node, and stayed in the caller's
+        Frame frames[MaxDepth];
+        U32 depth; // frames[0] is the root
+        U32 sample_period; // 0 to attribute every instruction
+        U32 cycles_until_sample;
+        U64 total_cycles;
+        U64* pc_cycles; // [0x10000], the cart and RAM, by address
+        U64* bootstrap_cycles; // [0x100], the bootstrap ROM
+
+        void init(U32 sample_period);
+        void release();
+
+        void add_cycles(U16 pc, U8 bank, U32 cycles) {
+            if(sample_period){
+                if(cycles < cycles_until_sample){
+                    cycles_until_sample -= cycles;
+                    return;
+                }
+                // each period that ended during this instruction is another sample of it
+                U32 overshoot = cycles - cycles_until_sample;
+                U32 samples = 1 + overshoot / sample_period;
+                cycles_until_sample = sample_period - overshoot % sample_period;
+                cycles = samples * sample_period;
+            }
+
+            total_cycles += cycles;
+            nodes[frames[depth].node].self_cycles += cycles;
+            if(bank == Cart::BootstrapBank){
+                bootstrap_cycles[pc & 0xFF] += cycles;
+            } else {
+                pc_cycles[pc] += cycles;
+            }
+        }
+
+        void call(U16 target, U8 bank, U16 return_address, BOOL32 interrupt);
+        void ret(U16 return_address);
+
+        // one line per call chain: "BS:0000;00:0150;00:2A3C 12345"
+        void write_folded(FILE* f) const;
+        // one line per address that used any cycles: "00:2A3C 12345"
+        void write_pc_cycles(FILE* f) const;
+
+    private:
+        void write_folded_node(FILE* f, U32 node_idx, char* path, U32 path_length) const;
+    };
+} //namespace Profiler
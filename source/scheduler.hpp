@@ -0,0 +1,86 @@
+//
+//  scheduler.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include "types.hpp"
+
+namespace Scheduler {
+    /*
+     Things that will happen at a known cycle in the future. Instead of every subsystem
+     counting down on every instruction, each one puts a deadline here, and the run loop
+     only compares the cycle counter against the earliest deadline.
+     */
+    enum Event {
+        Event_DMAComplete,
+        Event_TimerOverflow,
+        Event_SerialTransfer,
+        Event_LinkSync,
+        EventCount,
+    };
+
+    const U64 Never = ~0ULL;
+
+    struct Scheduler {
+        U64 cycles; // since power on
+        U64 next_deadline; // the earliest of `deadlines`
+        U64 deadlines[EventCount]; // `Never` when not scheduled
+
+        void reset() {
+            cycles = 0;
+            for(unsigned event = 0; event < EventCount; ++event){
+                deadlines[event] = Never;
+            }
+            next_deadline = Never;
+        }
+
+        // replaces any deadline already set for `event`
+        void schedule(Event event, U64 deadline) {
+            U64 previous_deadline = deadlines[event];
+            deadlines[event] = deadline;
+            if(deadline < next_deadline){
+                next_deadline = deadline;
+            } else if(previous_deadline == next_deadline){
+                update_next_deadline(); // this may have been the earliest
+            }
+        }
+
+        void cancel(Event event) {
+            deadlines[event] = Never;
+            update_next_deadline();
+        }
+
+        BOOL32 any_due() const {
+            return cycles >= next_deadline;
+        }
+
+        // removes the earliest event that is due, if there is one
+        BOOL32 pop_due_event(Event* out_event) {
+            if(!any_due())
+                return False;
+
+            unsigned earliest = 0;
+            for(unsigned event = 1; event < EventCount; ++event){
+                if(deadlines[event] < deadlines[earliest]){
+                    earliest = event;
+                }
+            }
+
+            *out_event = (Event)earliest;
+            cancel(*out_event);
+            return True;
+        }
+
+    private:
+        void update_next_deadline() {
+            next_deadline = Never;
+            for(unsigned event = 0; event < EventCount; ++event){
+                if(deadlines[event] < next_deadline){
+                    next_deadline = deadlines[event];
+                }
+            }
+        }
+    };
+} //namespace Scheduler
@@ -0,0 +1,159 @@
+//
+//  serial.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include "types.hpp"
+#include "spsc_queue.hpp"
+
+/*
+ SC - Serial Transfer Control (R/W)
+
+    Bit 7 - Transfer Start Flag
+        0: Non transfer
+        1: Start transfer
+    Bit 0 - Shift Clock
+        0: External Clock (500KHz Max.)
+        1: Internal Clock (8192Hz)
+
+ Transfer is initiated by setting the Transfer Start Flag. This bit may be read and is
+ automatically set to 0 at the end of Transfer.
+
+ Transmitting and receiving serial data is done simultaneously. The received data is
+ automatically stored in SB.
+
+ The side using the internal clock drives the transfer, and is always done 8 bits after it
+ starts. The other side sets bit 7 with the external clock selected, and waits for it to happen.
+ */
+namespace Serial {
+    const U8 SCTransferStart = 0x80;
+    const U8 SCInternalClock = 0x01;
+
+    const U32 CyclesPerBit = 4194304 / 8192;
+    const U32 CyclesPerByte = CyclesPerBit * 8;
+
+    // how often a linked emulator tells the other one how far it has run
+    const U32 SyncCycles = CyclesPerByte / 4;
+
+    // an SC write, sent to the other side
+    struct Message {
+        U64 cycle; // when it was written
+        U8 sc;
+        U8 sb; // as it was when SC was written, which is what gets shifted out
+    };
+
+    typedef SPSCQueue<Message, 64> Channel;
+
+    /*
+     Joins the serial ports of two emulators, which can be on different threads. Each
+     direction is a lock-free ring of SC writes, and each side also publishes how far it has
+     run every `SyncCycles`.
+
+     Both sides work out each transfer from the cycles in the messages alone, so the result
+     doesn't depend on how the two are scheduled on the host:
+
+     - A side that starts a transfer with the internal clock at cycle T finishes at
+       T + `CyclesPerByte`. If the other side had started a transfer with the external clock
+       at or before T (and that start hasn't been used by an earlier transfer), they swap SBs,
+       and the other side finishes at the same cycle.
+       Otherwise, nothing shifts in and it receives 0xFF, just as with nothing plugged in.
+     - So if both sides use the internal clock, both receive 0xFF. If both use the external
+       clock, neither ever finishes, as on hardware.
+
+     A side only needs to wait when it's at a transfer point and the other side hasn't run
+     far enough for it to know what happened there, or when it writes SC and the ring is
+     still full of its earlier writes. Then its CPU stops without time passing
+     (`interrupts.link_waiting`) and `emulator_run_until_frame` returns early, until the
+     other side catches up.
+
+     Must outlive both emulators' use of it (see `emulator_connect_link`).
+     */
+    struct LinkCable {
+        Channel a_to_b;
+        Channel b_to_a;
+        std::atomic<U64> a_cycles; // everything a wrote before this cycle is already in `a_to_b`
+        std::atomic<U64> b_cycles;
+
+        LinkCable() : a_cycles(0), b_cycles(0) {}
+    };
+
+    /*
+     Test ROMs print their results by sending each character out of the serial port. This
+     keeps every byte sent, and notices when the output ends with one of `stop_patterns`
+     (e.g. "Passed" or "Failed") so a batch run can stop as soon as the result is known.
+     */
+    const U32 NoMatch = ~0U;
+
+    struct Capture {
+        U8* bytes; // not NUL terminated
+        U32 count;
+        U32 capacity;
+        const char* const* stop_patterns;
+        U32 stop_pattern_count;
+        U32 matched_pattern; // index into `stop_patterns`, `NoMatch` until one is seen
+
+        void init(const char* const* patterns, U32 pattern_count) {
+            bytes = NULL;
+            count = 0;
+            capacity = 0;
+            stop_patterns = patterns;
+            stop_pattern_count = pattern_count;
+            matched_pattern = NoMatch;
+        }
+
+        void release() {
+            free(bytes);
+            bytes = NULL;
+            count = capacity = 0;
+        }
+
+        void append(U8 byte) {
+            if(count == capacity){
+                capacity = (capacity ? capacity * 2 : 256);
+                bytes = (U8*)realloc(bytes, capacity);
+                assert(bytes);
+            }
+            bytes[count++] = byte;
+
+            if(matched_pattern != NoMatch)
+                return;
+            for(U32 i = 0; i < stop_pattern_count; ++i){
+                U32 length = (U32)strlen(stop_patterns[i]);
+                if(length <= count && memcmp(bytes + count - length, stop_patterns[i], length) == 0){
+                    matched_pattern = i;
+                    return;
+                }
+            }
+        }
+    };
+
+    struct Port {
+        U8 sb;
+        U8 sc;
+        U64 start_cycle; // when `sc` last started a transfer
+        U32 bytes_transferred;
+        Capture* capture; // NULL unless capturing
+
+        // only used while linked
+        Channel* outbox; // both NULL when nothing is plugged in
+        Channel* inbox;
+        std::atomic<U64>* cycles_out; // how far this side has run
+        std::atomic<U64>* peer_cycles; // how far the other side has run
+        Message peer; // the other side's latest SC write, as of the cycles taken from `inbox` so far
+        Message next; // taken from `inbox`, but not due yet
+        BOOL32 has_next;
+        U64 peer_used_cycle; // the other side's last external-clock start that a transfer from this side finished
+        Message unsent; // the SC write that `outbox` had no room for
+        BOOL32 has_unsent;
+        BOOL32 transfer_waiting; // for the other side, in `emu_serial_transfer`
+        U64 receive_cycle; // with the external clock, when the other side's transfer finishes
+        U8 receive_value;
+    };
+} //namespace Serial
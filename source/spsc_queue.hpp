@@ -0,0 +1,90 @@
+//
+//  spsc_queue.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <atomic>
+#include "types.hpp"
+
+/*
+ Bounded lock-free FIFO for exactly one producer thread and one consumer thread.
+
+ `Capacity` must be a power of two. One slot is always left empty, so at most
+ `Capacity - 1` elements can be queued at once.
+ */
+template<class T, U32 Capacity>
+struct SPSCQueue {
+    SPSCQueue() : head(0), tail(0) {}
+
+    // producer only. Returns False (and drops `value`) if the queue is full.
+    BOOL32 push(const T& value) {
+        U32 current_tail = tail.load(std::memory_order_relaxed);
+        U32 next_tail = (current_tail + 1) & IndexMask;
+        if(next_tail == head.load(std::memory_order_acquire))
+            return False;
+
+        elements[current_tail] = value;
+        tail.store(next_tail, std::memory_order_release);
+        return True;
+    }
+
+    // consumer only. Returns False if the queue is empty.
+    BOOL32 pop(T* out_value) {
+        U32 current_head = head.load(std::memory_order_relaxed);
+        if(current_head == tail.load(std::memory_order_acquire))
+            return False;
+
+        *out_value = elements[current_head];
+        head.store((current_head + 1) & IndexMask, std::memory_order_release);
+        return True;
+    }
+
+    // producer only. Pushes as many of `values` as fit, and returns how many that was.
+    U32 push_many(const T* values, U32 count) {
+        U32 current_tail = tail.load(std::memory_order_relaxed);
+        U32 free_slots = (head.load(std::memory_order_acquire) - current_tail - 1) & IndexMask;
+        if(count > free_slots){
+            count = free_slots;
+        }
+
+        for(U32 i = 0; i < count; ++i){
+            elements[(current_tail + i) & IndexMask] = values[i];
+        }
+        tail.store((current_tail + count) & IndexMask, std::memory_order_release);
+        return count;
+    }
+
+    // consumer only. Pops up to `max_count` elements, and returns how many there were.
+    U32 pop_many(T* out_values, U32 max_count) {
+        U32 current_head = head.load(std::memory_order_relaxed);
+        U32 count = (tail.load(std::memory_order_acquire) - current_head) & IndexMask;
+        if(count > max_count){
+            count = max_count;
+        }
+
+        for(U32 i = 0; i < count; ++i){
+            out_values[i] = elements[(current_head + i) & IndexMask];
+        }
+        head.store((current_head + count) & IndexMask, std::memory_order_release);
+        return count;
+    }
+
+    // either thread, but it may already be out of date by the time it's returned
+    U32 size() const {
+        return (tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire)) & IndexMask;
+    }
+
+private:
+    static const U32 IndexMask = Capacity - 1;
+    static_assert((Capacity & IndexMask) == 0, "SPSCQueue capacity must be a power of two");
+
+    T elements[Capacity];
+    // kept on separate cache lines, so the two threads don't keep stealing them from each other
+    alignas(64) std::atomic<U32> head; // next element to pop, written by the consumer
+    alignas(64) std::atomic<U32> tail; // next slot to push into, written by the producer
+
+    SPSCQueue(const SPSCQueue&);
+    SPSCQueue& operator=(const SPSCQueue&);
+};
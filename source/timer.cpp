@@ -7,31 +7,61 @@
 //
 
 #include "timer.hpp"
-/*
-void Timer::Update(U8 cycles_elapsed) {
-    if(!(tac & TACRunningMask))
-        return False;
-
-    // update div
-    div_cycles_elapsed += cycles_elapsed;
-    if(div_cycles_elapsed > CyclesPerTickByFrequency[TACFrequency16384]){
-        div += 1;
-        div_cycles_elapsed -= CyclesPerTickByFrequency[TACFrequency16384];
-    }
+#include "scheduler.hpp"
+
+U8 Timer::Timer::div(U64 now) const {
+    return (U8)((now - div_reset_cycle) / CyclesPerDIVTick);
+}
+
+U8 Timer::Timer::tima(U64 now) const {
+    if(!running())
+        return tima_base;
 
-    // update tima
-    tima_cycles_elapsed += cycles_elapsed;
-    U16 tima_cycles_per_tick = CyclesPerTickByFrequency[tac & TACFrequencyMask];
-    BOOL32 trigger_interrupt = False;
-
-    if(tima_cycles_elapsed > tima_cycles_per_tick){
-        tima_cycles_elapsed -= tima_cycles_per_tick;
-        tima += 1;
-        if(tima == 0){
-            tima = tma;
-            trigger_interrupt = True;
-        }
+    // how many multiples of the period the internal counter has passed since `tima_base_cycle`
+    U16 period = cycles_per_tick();
+    U64 ticks = (now - div_reset_cycle) / period - (tima_base_cycle - div_reset_cycle) / period;
+
+    U32 ticks_until_overflow = 0x100 - tima_base;
+    if(ticks < ticks_until_overflow){
+        return (U8)(tima_base + ticks);
     }
 
-    return trigger_interrupt;
-}*/
\ No newline at end of file
+    // reloaded from TMA on overflow, then maybe overflowed again
+    ticks -= ticks_until_overflow;
+    return (U8)(tma + ticks % (0x100 - tma));
+}
+
+U64 Timer::Timer::overflow_deadline() const {
+    if(!running())
+        return Scheduler::Never;
+
+    U16 period = cycles_per_tick();
+    U64 base_tick = (tima_base_cycle - div_reset_cycle) / period;
+    U64 overflow_tick = base_tick + (0x100 - tima_base);
+    return div_reset_cycle + overflow_tick * period;
+}
+
+void Timer::Timer::sync(U64 now) {
+    tima_base = tima(now);
+    tima_base_cycle = now;
+}
+
+void Timer::Timer::write_div(U64 now) {
+    sync(now);
+    div_reset_cycle = now;
+}
+
+void Timer::Timer::write_tima(U64 now, U8 value) {
+    sync(now);
+    tima_base = value;
+}
+
+void Timer::Timer::write_tma(U64 now, U8 value) {
+    sync(now);
+    tma = value;
+}
+
+void Timer::Timer::write_tac(U64 now, U8 value) {
+    sync(now);
+    tac = value;
+}
@@ -35,18 +35,35 @@ namespace Timer {
         CPUClockSpeed/16384
     };
 
+    // DIV counts at 16384Hz
+    const U16 CyclesPerDIVTick = CPUClockSpeed/16384;
+
     /*
-     The address of the interupt to call when TIMA overflows.
-     */
-    const U16 OverflowInterruptAddress = 0x0050;
+     The timer is never stepped. Everything is worked out from the global cycle counter when
+     it's needed: DIV when it's read, TIMA when it's read or written, and the next TIMA
+     overflow whenever the registers change, so the emulator can schedule it as an event.
 
+     Like the real thing, DIV is the top 8 bits of a counter that starts when DIV is reset,
+     and TIMA ticks whenever that counter passes a multiple of the selected period.
+     */
     struct Timer {
-        U8 div;
-        U8 tima;
+        U64 div_reset_cycle; // when DIV was last written
+        U64 tima_base_cycle; // when `tima_base` was last brought up to date
+        U8 tima_base;
         U8 tma;
         U8 tac;
 
-        U16 div_cycles_elapsed;
-        U16 tima_cycles_elapsed;
+        BOOL32 running() const { return (tac & TACRunningMask) != 0; }
+        U16 cycles_per_tick() const { return CyclesPerTickByFrequency[tac & TACFrequencyMask]; }
+
+        U8 div(U64 now) const;
+        U8 tima(U64 now) const;
+        U64 overflow_deadline() const; // `Scheduler::Never` if it won't overflow
+
+        void sync(U64 now);
+        void write_div(U64 now);
+        void write_tima(U64 now, U8 value);
+        void write_tma(U64 now, U8 value);
+        void write_tac(U64 now, U8 value);
     };
 };
\ No newline at end of file
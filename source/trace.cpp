@@ -0,0 +1,70 @@
+//
+//  trace.cpp
+//  gemuboi
+//
+
+#include "trace.hpp"
+#include <cassert>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static_assert(sizeof(Trace::Record) == 24, "trace files depend on the record layout");
+static_assert(sizeof(Trace::Header) % 64 == 0, "records should start on a cache line");
+
+BOOL32 Trace::Ring::open(U64 capacity, const char* filename) {
+    assert(capacity && (capacity & (capacity - 1)) == 0); // must be a power of 2
+
+    memory_size = sizeof(Header) + capacity * sizeof(Record);
+    fd = -1;
+
+    if(filename){
+        fd = ::open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+            return False;
+        if(ftruncate(fd, (off_t)memory_size) != 0){
+            ::close(fd);
+            return False;
+        }
+        memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    } else {
+        memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    }
+
+    if(memory == MAP_FAILED){
+        if(fd >= 0){
+            ::close(fd);
+        }
+        return False;
+    }
+
+    // both kinds of mapping start zeroed, but writing to each page up front means the emulator
+    // doesn't take a page fault every 170 records while it runs
+    memset(memory, 0, memory_size);
+
+    header = (Header*)memory;
+    records = (Record*)(header + 1);
+    memcpy(header->magic, Magic, sizeof(Magic));
+    header->version = Version;
+    header->record_size = sizeof(Record);
+    header->capacity = capacity;
+    header->written.store(0, std::memory_order_relaxed);
+    mask = capacity - 1;
+    written = 0;
+    return True;
+}
+
+void Trace::Ring::close() {
+    munmap(memory, memory_size);
+    if(fd >= 0){
+        // trims a trace that never wrapped down to the records in it
+        if(written < mask + 1){
+            ftruncate(fd, (off_t)(sizeof(Header) + written * sizeof(Record)));
+        }
+        ::close(fd);
+    }
+    memory = NULL;
+    header = NULL;
+    records = NULL;
+}
@@ -0,0 +1,80 @@
+//
+//  trace.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <atomic>
+#include <string.h>
+#include "types.hpp"
+#include "cart.hpp"
+
+namespace Trace {
+    const U32 Version = 1;
+    const char Magic[8] = { 'G', 'B', 'T', 'R', 'A', 'C', 'E', '\0' };
+
+    const U64 DefaultCapacity = 1 << 22; // records, 96MB
+
+    /*
+     One instruction, as it was just before it ran. The registers are in the same order as
+     `CPU::Registers`, so they're copied in one go.
+     */
+    struct Record {
+        U16 af;
+        U16 bc;
+        U16 de;
+        U16 hl;
+        U16 sp;
+        U16 pc;
+        U8 bank; // the ROM bank PC was in, or `Cart::BootstrapBank`
+        U8 instr[3]; // the opcode and its operands. Bytes past the opcode's `byte_length` are 0, not what follows it in memory
+        U64 cycle;
+    };
+
+    /*
+     The start of a trace, followed by `capacity` records. A trace file is exactly this, so
+     a mapped file is complete as soon as each record is written, and still readable if the
+     emulator dies.
+     */
+    struct Header {
+        char magic[8];
+        U32 version;
+        U32 record_size;
+        U64 capacity; // a power of 2
+        std::atomic<U64> written; // every record ever appended, only the last `capacity` are kept
+        U8 padding[32]; // keeps the records cache line aligned
+    };
+
+    /*
+     A ring of the most recent records, for one emulator. There is only ever one writer (the
+     thread running the emulator), which publishes `Header::written` after each record, so
+     another thread can read the ring without a lock: take `written`, copy the records, then
+     check `written` again to see how many at the old end were overwritten while copying.
+     */
+    struct Ring {
+        Header* header;
+        Record* records;
+        U64 mask; // capacity - 1
+        U64 written; // the writer's copy of `Header::written`
+        void* memory;
+        U64 memory_size;
+        int fd; // -1 unless a file is mapped
+
+        // if `filename` isn't NULL, the ring is a memory-mapped file. Returns False on failure
+        BOOL32 open(U64 capacity, const char* filename);
+        void close();
+
+        void append(const void* registers, U8 bank, const U8* instr, U64 cycle) {
+            Record* record = &records[written & mask];
+            memcpy(record, registers, 6 * sizeof(U16));
+            record->bank = bank;
+            record->instr[0] = instr[0];
+            record->instr[1] = instr[1];
+            record->instr[2] = instr[2];
+            record->cycle = cycle;
+            written += 1;
+            header->written.store(written, std::memory_order_release);
+        }
+    };
+} //namespace Trace
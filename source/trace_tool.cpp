@@ -0,0 +1,107 @@
+//
+//  trace_tool.cpp
+//  gemuboi
+//
+
+/*
+ gemuboi-trace <trace file> [last N instructions]
+
+ Decodes a trace written by `gemuboi <cart> --trace <file>` into one line per instruction,
+ oldest first:
+
+    cycle        bank:pc   bytes     instruction            registers before it ran
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "cpu.hpp"
+#include "trace.hpp"
+
+static void print_record(const Trace::Record* record) {
+    const U8* instr = record->instr;
+    const CPU::OpcodeDesc* opcode = (instr[0] == 0xCB ? &CPU::CBPrefixedOpcodes[instr[1]] : &CPU::Opcodes[instr[0]]);
+
+    char bank[3];
+    if(record->bank == Cart::BootstrapBank){
+        strcpy(bank, "BS");
+    } else {
+        snprintf(bank, sizeof(bank), "%0.2X", (unsigned)record->bank);
+    }
+
+    char bytes[10];
+    char operand[10] = "";
+    switch(opcode->byte_length){
+        case 2:
+            snprintf(bytes, sizeof(bytes), "%0.2X %0.2X", instr[0], instr[1]);
+            if(instr[0] != 0xCB){
+                snprintf(operand, sizeof(operand), "[0x%0.2X]", instr[1]);
+            }
+            break;
+        case 3:
+            snprintf(bytes, sizeof(bytes), "%0.2X %0.2X %0.2X", instr[0], instr[1], instr[2]);
+            snprintf(operand, sizeof(operand), "[0x%0.2X%0.2X]", instr[2], instr[1]);
+            break;
+        default:
+            snprintf(bytes, sizeof(bytes), "%0.2X", instr[0]);
+            break;
+    }
+
+    printf("%12llu %s:%0.4X  %-8s  %-14s %-8s  AF=%0.4X BC=%0.4X DE=%0.4X HL=%0.4X SP=%0.4X\n",
+           (unsigned long long)record->cycle, bank, (unsigned)record->pc,
+           bytes, opcode->description, operand,
+           (unsigned)record->af, (unsigned)record->bc, (unsigned)record->de, (unsigned)record->hl,
+           (unsigned)record->sp);
+}
+
+int main(int argc, const char* argv[]) {
+    if(argc < 2){
+        fprintf(stderr, "usage: %s <trace file> [last N instructions]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE* f = fopen(argv[1], "rb");
+    if(!f){
+        fprintf(stderr, "Couldn't open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    Trace::Header header;
+    if(fread(&header, sizeof(header), 1, f) != 1 ||
+       memcmp(header.magic, Trace::Magic, sizeof(Trace::Magic)) != 0 ||
+       header.version != Trace::Version ||
+       header.record_size != sizeof(Trace::Record))
+    {
+        fprintf(stderr, "%s isn't a version %u trace\n", argv[1], Trace::Version);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+
+    // once the ring has wrapped, the oldest record is the one after the newest
+    U64 written = header.written.load();
+    U64 count = (written < header.capacity ? written : header.capacity);
+    if(argc >= 3){
+        U64 last = strtoull(argv[2], NULL, 10);
+        if(last < count){
+            count = last;
+        }
+    }
+
+    U64 stored = (written < header.capacity ? written : header.capacity);
+    Trace::Record* records = (Trace::Record*)malloc(stored * sizeof(Trace::Record));
+    if(fread(records, sizeof(Trace::Record), stored, f) != stored){
+        fprintf(stderr, "%s is truncated\n", argv[1]);
+        free(records);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
+    fclose(f);
+
+    U64 mask = header.capacity - 1;
+    for(U64 idx = written - count; idx < written; ++idx){
+        print_record(&records[idx & mask]);
+    }
+
+    free(records);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,57 @@
+//
+//  triple_buffer.hpp
+//  gemuboi
+//
+
+#pragma once
+
+#include <atomic>
+#include "types.hpp"
+
+/*
+ Lock-free triple buffering between exactly one producer thread and one consumer thread.
+
+ The producer always has a back buffer to write into, and the consumer always has a front
+ buffer to read from. Neither ever waits for the other. `publish` swaps the back buffer with
+ the spare (middle) one, and `update_front` swaps the front buffer with the spare if anything
+ newer has been published since. Frames that the consumer was too slow to pick up are simply
+ overwritten, so the consumer always sees the newest complete one.
+ */
+template<class T>
+struct TripleBuffer {
+    TripleBuffer() : middle(1), back(0), front(2) {}
+
+    // producer only
+    T* back_buffer() { return &buffers[back]; }
+
+    // producer only
+    void publish() {
+        U8 old_middle = middle.exchange(back | NewDataFlag, std::memory_order_acq_rel);
+        back = old_middle & IndexMask;
+    }
+
+    // consumer only. Returns True if the front buffer changed.
+    BOOL32 update_front() {
+        if(!(middle.load(std::memory_order_relaxed) & NewDataFlag))
+            return False;
+
+        U8 old_middle = middle.exchange(front, std::memory_order_acq_rel);
+        front = old_middle & IndexMask;
+        return True;
+    }
+
+    // consumer only
+    const T* front_buffer() const { return &buffers[front]; }
+
+private:
+    static const U8 IndexMask = 0x03;
+    static const U8 NewDataFlag = 0x04;
+
+    T buffers[3];
+    std::atomic<U8> middle; // index of the spare buffer, plus NewDataFlag
+    U8 back;
+    U8 front;
+
+    TripleBuffer(const TripleBuffer&);
+    TripleBuffer& operator=(const TripleBuffer&);
+};
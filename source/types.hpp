@@ -2,8 +2,10 @@
 
 typedef unsigned char U8;
 typedef signed char S8;
+typedef signed short S16;
 typedef unsigned short U16;
 typedef unsigned int U32;
+typedef unsigned long long U64;
 typedef unsigned int BOOL32;
 
 const BOOL32 True = 1;
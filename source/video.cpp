@@ -7,6 +7,12 @@
 //
 
 #include "video.hpp"
+#include "counters.hpp"
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 
 // returns 0, 1, 2, or 3
@@ -16,31 +22,731 @@ U8 Video::Tile::Row::unpack_pixel(U8 pixel_idx) {
     return (bit0 | bit1);
 }
 
+// converts an index from a tilemap into an index into `VRAM::tiles`
+static inline unsigned tilemap_tile_index(U8 tilemap_value, BOOL32 signed_tiles) {
+    if(signed_tiles){
+        // tile 0 is at 0x9000, which is the 256th tile
+        return 256 + (int)(S8)tilemap_value;
+    } else {
+        return tilemap_value;
+    }
+}
+
+
+/*
+ Spreads the 8 bits of `bits` out into the 8 bytes of a U64, so that byte 0 in
+ memory holds bit 7 (the leftmost pixel) and byte 7 holds bit 0. Each byte ends up
+ as either 0 or 1.
+
+ Assumes a little-endian host, which `test()` in main.cpp checks.
+ */
+static inline U64 spread_bits_to_bytes(U8 bits) {
+    const U64 broadcast = 0x0101010101010101ULL;
+    const U64 bit_masks = 0x0102040810204080ULL; // byte 0 = 0x80 ... byte 7 = 0x01
+    U64 isolated = (bits * broadcast) & bit_masks;
+    // any non-zero byte now gets its top bit set, without carrying into its neighbour
+    return ((isolated + 0x7F7F7F7F7F7F7F7FULL) >> 7) & broadcast;
+}
+
+static inline U64 decode_tile_row(Video::Tile::Row row) {
+    return spread_bits_to_bytes(row.b1) | (spread_bits_to_bytes(row.b2) << 1);
+}
+
+// reverses the order of the 8 pixels in a decoded row
+static inline U64 flip_decoded_row(U64 decoded_row) {
+    return __builtin_bswap64(decoded_row);
+}
+
+void Video::decode_tile_rows(const Tile::Row* rows, unsigned row_count, U8* out) {
+    unsigned row_idx = 0;
+
+#if defined(__SSE2__)
+    /*
+     Eight rows (16 bytes of interleaved b1/b2) at a time. Each bitplane byte gets
+     broadcast across the 8 byte lanes of its row, then every lane tests its own bit.
+     */
+    const __m128i low_byte_mask = _mm_set1_epi16(0x00FF);
+    const __m128i bit_masks = _mm_set_epi8(0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80,
+                                           0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, (char)0x80);
+    const __m128i ones = _mm_set1_epi8(1);
+    const __m128i twos = _mm_set1_epi8(2);
+
+    for(; row_idx + 8 <= row_count; row_idx += 8){
+        __m128i interleaved = _mm_loadu_si128((const __m128i*)(rows + row_idx));
+        __m128i zero = _mm_setzero_si128();
+        // b1 of rows 0-7 in bytes 0-7, and the same for b2
+        __m128i b1s = _mm_packus_epi16(_mm_and_si128(interleaved, low_byte_mask), zero);
+        __m128i b2s = _mm_packus_epi16(_mm_srli_epi16(interleaved, 8), zero);
+
+        // each byte repeated 4 times: rows 0-3 in the low half, rows 4-7 in the high half
+        __m128i b1_x2 = _mm_unpacklo_epi8(b1s, b1s);
+        __m128i b2_x2 = _mm_unpacklo_epi8(b2s, b2s);
+        __m128i b1_x4[2] = { _mm_unpacklo_epi16(b1_x2, b1_x2), _mm_unpackhi_epi16(b1_x2, b1_x2) };
+        __m128i b2_x4[2] = { _mm_unpacklo_epi16(b2_x2, b2_x2), _mm_unpackhi_epi16(b2_x2, b2_x2) };
+
+        for(unsigned half = 0; half < 2; ++half){
+            // each byte repeated 8 times, two rows per register
+            __m128i b1_x8[2] = { _mm_unpacklo_epi32(b1_x4[half], b1_x4[half]), _mm_unpackhi_epi32(b1_x4[half], b1_x4[half]) };
+            __m128i b2_x8[2] = { _mm_unpacklo_epi32(b2_x4[half], b2_x4[half]), _mm_unpackhi_epi32(b2_x4[half], b2_x4[half]) };
+
+            for(unsigned pair = 0; pair < 2; ++pair){
+                __m128i bit0 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b1_x8[pair], bit_masks), bit_masks), ones);
+                __m128i bit1 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(b2_x8[pair], bit_masks), bit_masks), twos);
+                U8* dest = out + (row_idx + half*4 + pair*2) * Tile::PixelSize;
+                _mm_storeu_si128((__m128i*)dest, _mm_or_si128(bit0, bit1));
+            }
+        }
+    }
+#endif
+
+    decode_tile_rows_portable(rows + row_idx, row_count - row_idx, out + row_idx * Tile::PixelSize);
+}
+
+void Video::decode_tile_rows_portable(const Tile::Row* rows, unsigned row_count, U8* out) {
+    for(unsigned row_idx = 0; row_idx < row_count; ++row_idx){
+        U64 decoded = decode_tile_row(rows[row_idx]);
+        memcpy(out + row_idx * Tile::PixelSize, &decoded, sizeof(decoded));
+    }
+}
+
+
+void Video::TileCache::decode_all(const VRAM* vram) {
+    decode_tile_rows(&vram->tiles[0].rows[0],
+                     VRAM::TileCount * Tile::PixelSize,
+                     &tiles[TileFlip_None][0].pixels[0][0]);
+
+    for(unsigned tile_idx = 0; tile_idx < VRAM::TileCount; ++tile_idx){
+        for(unsigned row_idx = 0; row_idx < Tile::PixelSize; ++row_idx){
+            unsigned flipped_row_idx = (Tile::PixelSize - 1) - row_idx;
+            U64 normal;
+            memcpy(&normal, tiles[TileFlip_None][tile_idx].pixels[row_idx], sizeof(normal));
+            U64 flipped = flip_decoded_row(normal);
+            memcpy(tiles[TileFlip_X][tile_idx].pixels[row_idx], &flipped, sizeof(flipped));
+            memcpy(tiles[TileFlip_Y][tile_idx].pixels[flipped_row_idx], &normal, sizeof(normal));
+            memcpy(tiles[TileFlip_XY][tile_idx].pixels[flipped_row_idx], &flipped, sizeof(flipped));
+        }
+    }
+}
+
+void Video::TileCache::decode_row(const VRAM* vram, U16 vram_offset) {
+    assert(vram_offset < sizeof(vram->tiles));
+
+    unsigned tile_idx = vram_offset / sizeof(Tile);
+    unsigned row_idx = (vram_offset % sizeof(Tile)) / sizeof(Tile::Row);
+    unsigned flipped_row_idx = (Tile::PixelSize - 1) - row_idx;
+
+    U64 normal = decode_tile_row(vram->tiles[tile_idx].rows[row_idx]);
+    U64 flipped = flip_decoded_row(normal);
+    memcpy(tiles[TileFlip_None][tile_idx].pixels[row_idx], &normal, sizeof(normal));
+    memcpy(tiles[TileFlip_X][tile_idx].pixels[row_idx], &flipped, sizeof(flipped));
+    memcpy(tiles[TileFlip_Y][tile_idx].pixels[flipped_row_idx], &normal, sizeof(normal));
+    memcpy(tiles[TileFlip_XY][tile_idx].pixels[flipped_row_idx], &flipped, sizeof(flipped));
+}
+
+
+U32 Video::host_color(U8 r, U8 g, U8 b, HostPixelFormat format) {
+    switch(format){
+        case HostPixelFormat_ARGB8888:
+            return 0xFF000000 | ((U32)r << 16) | ((U32)g << 8) | (U32)b;
+        case HostPixelFormat_RGB565:
+            return ((U32)(r >> 3) << 11) | ((U32)(g >> 2) << 5) | (U32)(b >> 3);
+    }
+    assert(0); //unknown format
+    return 0;
+}
+
+void Video::convert_shades_to_host(const U8* shades, unsigned count, const U32 palette[4], HostPixelFormat format, void* out) {
+    unsigned idx = 0;
+
+    if(format == HostPixelFormat_ARGB8888){
+        U32* dest = (U32*)out;
+#if defined(__SSE2__)
+        // four pixels at a time: widen each shade to 32 bits, then select a palette entry by mask
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i colors[4] = {
+            _mm_set1_epi32((int)palette[0]), _mm_set1_epi32((int)palette[1]),
+            _mm_set1_epi32((int)palette[2]), _mm_set1_epi32((int)palette[3]),
+        };
+        for(; idx + 16 <= count; idx += 16){
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(shades + idx));
+            __m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+            for(unsigned w = 0; w < 2; ++w){
+                __m128i dwords[2] = { _mm_unpacklo_epi16(words[w], zero), _mm_unpackhi_epi16(words[w], zero) };
+                for(unsigned d = 0; d < 2; ++d){
+                    __m128i result = _mm_and_si128(_mm_cmpeq_epi32(dwords[d], _mm_setzero_si128()), colors[0]);
+                    for(int shade = 1; shade < 4; ++shade){
+                        __m128i mask = _mm_cmpeq_epi32(dwords[d], _mm_set1_epi32(shade));
+                        result = _mm_or_si128(result, _mm_and_si128(mask, colors[shade]));
+                    }
+                    _mm_storeu_si128((__m128i*)(dest + idx + w*8 + d*4), result);
+                }
+            }
+        }
+#endif
+        for(; idx < count; ++idx){
+            dest[idx] = palette[shades[idx] & 0x03];
+        }
+    } else {
+        U16* dest = (U16*)out;
+#if defined(__SSE2__)
+        // eight pixels at a time, same idea with 16 bit lanes
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i colors[4] = {
+            _mm_set1_epi16((short)palette[0]), _mm_set1_epi16((short)palette[1]),
+            _mm_set1_epi16((short)palette[2]), _mm_set1_epi16((short)palette[3]),
+        };
+        for(; idx + 16 <= count; idx += 16){
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(shades + idx));
+            __m128i words[2] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+            for(unsigned w = 0; w < 2; ++w){
+                __m128i result = _mm_and_si128(_mm_cmpeq_epi16(words[w], zero), colors[0]);
+                for(int shade = 1; shade < 4; ++shade){
+                    __m128i mask = _mm_cmpeq_epi16(words[w], _mm_set1_epi16((short)shade));
+                    result = _mm_or_si128(result, _mm_and_si128(mask, colors[shade]));
+                }
+                _mm_storeu_si128((__m128i*)(dest + idx + w*8), result);
+            }
+        }
+#endif
+        for(; idx < count; ++idx){
+            dest[idx] = (U16)palette[shades[idx] & 0x03];
+        }
+    }
+}
+
+
+void Video::pack_2bpp(const U8* shades, unsigned pixel_count, U8* out_packed) {
+    assert(pixel_count % 4 == 0);
+    unsigned idx = 0;
+
+#if defined(__SSE2__)
+    /*
+     32 pixels -> 8 bytes. Each round merges neighbouring pairs within 16 bit lanes, with
+     the left one in the high bits, then narrows back down to bytes.
+     */
+    const __m128i low_byte_mask = _mm_set1_epi16(0x00FF);
+    for(; idx + 32 <= pixel_count; idx += 32){
+        __m128i pixels[2] = {
+            _mm_loadu_si128((const __m128i*)(shades + idx)),
+            _mm_loadu_si128((const __m128i*)(shades + idx + 16)),
+        };
+        __m128i nibbles[2];
+        for(unsigned i = 0; i < 2; ++i){
+            __m128i left = _mm_slli_epi16(_mm_and_si128(pixels[i], low_byte_mask), 2);
+            __m128i right = _mm_srli_epi16(pixels[i], 8);
+            nibbles[i] = _mm_or_si128(left, right);
+        }
+        __m128i nibble_bytes = _mm_packus_epi16(nibbles[0], nibbles[1]);
+
+        __m128i left = _mm_slli_epi16(_mm_and_si128(nibble_bytes, low_byte_mask), 4);
+        __m128i right = _mm_srli_epi16(nibble_bytes, 8);
+        __m128i packed = _mm_packus_epi16(_mm_or_si128(left, right), _mm_setzero_si128());
+        _mm_storel_epi64((__m128i*)(out_packed + idx/4), packed);
+    }
+#endif
+
+    for(; idx < pixel_count; idx += 4){
+        out_packed[idx/4] = (U8)(((shades[idx] & 0x03) << 6) |
+                                 ((shades[idx+1] & 0x03) << 4) |
+                                 ((shades[idx+2] & 0x03) << 2) |
+                                 (shades[idx+3] & 0x03));
+    }
+}
+
+void Video::unpack_2bpp(const U8* packed, unsigned pixel_count, U8* out_shades) {
+    assert(pixel_count % 4 == 0);
+    unsigned idx = 0;
+
+#if defined(__SSE2__)
+    // 8 bytes -> 32 pixels, the reverse of pack_2bpp
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low_nibble_mask = _mm_set1_epi16(0x000F);
+    const __m128i low_pair_mask = _mm_set1_epi16(0x0003);
+    for(; idx + 32 <= pixel_count; idx += 32){
+        __m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(packed + idx/4)), zero);
+        __m128i nibbles = _mm_or_si128(_mm_srli_epi16(bytes, 4),
+                                       _mm_slli_epi16(_mm_and_si128(bytes, low_nibble_mask), 8));
+
+        __m128i halves[2] = { _mm_unpacklo_epi8(nibbles, zero), _mm_unpackhi_epi8(nibbles, zero) };
+        for(unsigned i = 0; i < 2; ++i){
+            __m128i pixels = _mm_or_si128(_mm_srli_epi16(halves[i], 2),
+                                          _mm_slli_epi16(_mm_and_si128(halves[i], low_pair_mask), 8));
+            _mm_storeu_si128((__m128i*)(out_shades + idx + i*16), pixels);
+        }
+    }
+#endif
+
+    for(; idx < pixel_count; idx += 4){
+        U8 byte = packed[idx/4];
+        out_shades[idx] = (byte >> 6) & 0x03;
+        out_shades[idx+1] = (byte >> 4) & 0x03;
+        out_shades[idx+2] = (byte >> 2) & 0x03;
+        out_shades[idx+3] = byte & 0x03;
+    }
+}
+
+
+void Video::SpriteIndex::rebuild(const OAM* oam, U8 height) {
+    sprite_height = height;
+    memset(line_masks, 0, sizeof(line_masks));
+    for(unsigned sprite_idx = 0; sprite_idx < OAM::SpriteCount; ++sprite_idx){
+        set_coverage(sprite_idx, oam->sprites[sprite_idx].y, True);
+    }
+    for(unsigned line_idx = 0; line_idx < ViewportHeight; ++line_idx){
+        line_stale[line_idx] = True;
+    }
+}
+
+// called after any byte of a sprite's OAM entry changes
+void Video::SpriteIndex::sprite_written(const OAM* oam, U8 sprite_idx, U8 old_y, U8 old_x) {
+    const Sprite* sprite = &oam->sprites[sprite_idx];
+    if(sprite->y != old_y){
+        set_coverage(sprite_idx, old_y, False);
+        set_coverage(sprite_idx, sprite->y, True);
+    } else if(sprite->x != old_x){
+        // same lines, but the order on them may have changed
+        mark_stale(sprite->y);
+    }
+}
+
+// adds or removes a sprite at `y` from every line it covers
+void Video::SpriteIndex::set_coverage(U8 sprite_idx, U8 y, BOOL32 covered) {
+    U64 bit = 1ULL << sprite_idx;
+    int top = (int)y - SpriteYOffset;
+    for(int line_idx = top; line_idx < top + sprite_height; ++line_idx){
+        if(line_idx < 0 || line_idx >= ViewportHeight)
+            continue;
+        if(covered){
+            line_masks[line_idx] |= bit;
+        } else {
+            line_masks[line_idx] &= ~bit;
+        }
+        line_stale[line_idx] = True;
+    }
+}
+
+void Video::SpriteIndex::mark_stale(U8 y) {
+    int top = (int)y - SpriteYOffset;
+    for(int line_idx = top; line_idx < top + sprite_height; ++line_idx){
+        if(line_idx >= 0 && line_idx < ViewportHeight){
+            line_stale[line_idx] = True;
+        }
+    }
+}
+
+const U8* Video::SpriteIndex::line(const OAM* oam, U8 line_idx, unsigned* out_count) {
+    U8* list = lines[line_idx];
+
+    if(line_stale[line_idx]){
+        // the first 10 in OAM order...
+        U64 mask = line_masks[line_idx];
+        unsigned count = 0;
+        while(mask && count < MaxSpritesPerLine){
+            list[count++] = (U8)__builtin_ctzll(mask);
+            mask &= mask - 1;
+        }
+
+        // ...then a stable sort by X, so ties stay in OAM order
+        for(unsigned i = 1; i < count; ++i){
+            U8 sprite_idx = list[i];
+            U8 x = oam->sprites[sprite_idx].x;
+            unsigned j = i;
+            while(j > 0 && oam->sprites[list[j-1]].x > x){
+                list[j] = list[j-1];
+                --j;
+            }
+            list[j] = sprite_idx;
+        }
+
+        line_counts[line_idx] = count;
+        line_stale[line_idx] = False;
+    }
+
+    *out_count = line_counts[line_idx];
+    return list;
+}
+
 
 Video::GPU::GPU() :
-    viewport(ViewportWidth, ViewportHeight),
-    window(ScreenBufferSize, ScreenBufferSize),
-    background(ScreenBufferSize, ScreenBufferSize),
-    tileset(Tileset_PixelsPerRow, Tileset_PixelsPerColumn)
+    line(0),
+    lyc(0),
+    stat_select(0),
+    mode(HBLANK_MODE),
+    cycles_elapsed(0),
+    frame_number(0),
+    frame_waiting(False),
+    render_thread_enabled(False),
+    window_line(0),
+    next_render_line(0),
+    frames_rendered(0),
+    raster_log_idx(0),
+    raster_log_count(0),
+    viewport_format(ViewportFormat_Shades),
+    viewport(new Bitmap(ViewportWidth, ViewportHeight)),
+    packed_viewport(NULL),
+    tileset(NULL),
+    window(NULL),
+    background(NULL),
+    vram_version(1),
+    tileset_version(0),
+    window_version(0),
+    background_version(0),
+    host_framebuffer(NULL),
+    render_job_pending(False),
+    render_thread_quit(False),
+    render_job_log(NULL),
+    render_job_count(0),
+    render_ns(0),
+    render_thread_ns(0)
 {
-    viewport.clear(0);
-    window.clear(1);
-    background.clear(2);
-    tileset.clear(3);
+    viewport->clear(0);
+    memset(&frame_oam, 0, sizeof(frame_oam));
+    memset(&frame_registers, 0, sizeof(frame_registers));
+    sprite_index.rebuild(&frame_oam, 8);
+}
+
+Video::GPU::~GPU() {
+    set_render_thread(False);
+    delete viewport;
+    delete[] packed_viewport;
+    delete tileset;
+    delete window;
+    delete background;
+}
+
+// STAT bits
+static const U8 StatSelect_Coincidence = 0x40;
+static const U8 StatSelect_OAM = 0x20;
+static const U8 StatSelect_VBlank = 0x10;
+static const U8 StatSelect_HBlank = 0x08;
+static const U8 Stat_Coincidence = 0x04;
+
+// the registers that are read while rendering
+static inline BOOL32 is_raster_register(U16 address) {
+    switch(address){
+        case HardwareRegisters::LCDC:
+        case HardwareRegisters::SCY:
+        case HardwareRegisters::SCX:
+        case HardwareRegisters::BGP:
+        case HardwareRegisters::OBP0:
+        case HardwareRegisters::OBP1:
+        case HardwareRegisters::WY:
+        case HardwareRegisters::WX:
+            return True;
+        default:
+            return False;
+    }
+}
+
+void Video::GPU::write_vram(U16 vram_offset, U8 value) {
+    vram.memory[vram_offset] = value;
+    log_write(VRAMAddress + vram_offset, value);
+}
+
+void Video::GPU::write_oam(U16 oam_offset, U8 value) {
+    log_write(OAMAddress + oam_offset, value);
 }
 
-void Video::GPU::step(U8 cycles) {
-    BOOL32 redraw = step_mode(cycles);
-    if(redraw){
+void Video::GPU::write_register(U16 address, U8 value) {
+    if(address == HardwareRegisters::STAT){
+        stat_select = value & (StatSelect_HBlank | StatSelect_VBlank | StatSelect_OAM | StatSelect_Coincidence);
+    } else if(address == HardwareRegisters::LYC){
+        lyc = value;
+    } else if(is_raster_register(address)){
+        log_write(address, value);
+    }
+}
+
+void Video::GPU::reset_vram() {
+    catch_up();
+    frame_vram = vram;
+    vram_version += 1;
+    tile_cache.decode_all(&frame_vram);
+}
+
+U16 Video::GPU::current_dot() const {
+    switch(mode){
+        case OAM_READ_MODE:
+            return cycles_elapsed;
+        case VRAM_READ_MODE:
+            return GPUModeDurations[OAM_READ_MODE] + cycles_elapsed;
+        case HBLANK_MODE:
+            return GPUModeDurations[OAM_READ_MODE] + GPUModeDurations[VRAM_READ_MODE] + cycles_elapsed;
+        case VBLANK_MODE:
+            return cycles_elapsed;
+    }
+    assert(0); //unknown mode
+    return 0;
+}
+
+void Video::GPU::log_write(U16 address, U8 value) {
+    if(raster_log_count == RasterLogCapacity){
+        catch_up();
+    }
+
+    RasterWrite* write = &raster_logs[raster_log_idx][raster_log_count++];
+    write->line = line;
+    write->dot = current_dot();
+    write->address = address;
+    write->value = value;
+}
+
+void Video::GPU::apply_write(const RasterWrite* write) {
+    if(write->address >= VRAMAddress && write->address < VRAMAddress + sizeof(VRAM)){
+        U16 vram_offset = write->address - VRAMAddress;
+        frame_vram.memory[vram_offset] = write->value;
+        vram_version += 1;
+        if(vram_offset < sizeof(frame_vram.tiles)){
+            tile_cache.decode_row(&frame_vram, vram_offset);
+        }
+    } else if(write->address >= OAMAddress && write->address < OAMAddress + sizeof(OAM)){
+        U16 oam_offset = write->address - OAMAddress;
+        U8 sprite_idx = oam_offset / sizeof(Sprite);
+        Sprite old_sprite = frame_oam.sprites[sprite_idx];
+        frame_oam.memory[oam_offset] = write->value;
+        sprite_index.sprite_written(&frame_oam, sprite_idx, old_sprite.y, old_sprite.x);
+    } else {
+        switch(write->address){
+            case HardwareRegisters::LCDC:
+                frame_registers.lcdc = write->value;
+                if(sprite_index.sprite_height != (frame_registers.lcdc_sprites_8x16() ? 16 : 8)){
+                    sprite_index.rebuild(&frame_oam, frame_registers.lcdc_sprites_8x16() ? 16 : 8);
+                }
+                break;
+            case HardwareRegisters::SCY: frame_registers.scy = write->value; break;
+            case HardwareRegisters::SCX: frame_registers.scx = write->value; break;
+            case HardwareRegisters::BGP: frame_registers.bgp = write->value; break;
+            case HardwareRegisters::OBP0: frame_registers.obp0 = write->value; break;
+            case HardwareRegisters::OBP1: frame_registers.obp1 = write->value; break;
+            case HardwareRegisters::WY: frame_registers.wy = write->value; break;
+            case HardwareRegisters::WX: frame_registers.wx = write->value; break;
+            default: assert(0); //not a logged address
+        }
+    }
+}
+
+// writes made during vblank show up from line 0 of the next frame
+static inline BOOL32 happens_before_line(const Video::RasterWrite* write, U8 line) {
+    // lines are rendered at the end of VRAM_READ_MODE
+    const U16 RenderDot = Video::GPUModeDurations[Video::OAM_READ_MODE] + Video::GPUModeDurations[Video::VRAM_READ_MODE];
+
+    if(write->line >= Video::ViewportHeight)
+        return True;
+    return (write->line < line || (write->line == line && write->dot < RenderDot));
+}
+
+/*
+ Renders lines up to (but not including) `lines_due`, applying each write in `log` just before
+ the first line that should see it. Whatever is left over is applied at the end.
+ */
+void Video::GPU::replay(const RasterWrite* log, unsigned count, U8 lines_due) {
+    unsigned log_idx = 0;
+    for(; next_render_line < lines_due; ++next_render_line){
+        while(log_idx < count && happens_before_line(&log[log_idx], next_render_line)){
+            apply_write(&log[log_idx]);
+            ++log_idx;
+        }
+        render_line(next_render_line);
+    }
+
+    for(; log_idx < count; ++log_idx){
+        apply_write(&log[log_idx]);
+    }
+
+    if(next_render_line == ViewportHeight){
+        next_render_line = 0;
+        frames_rendered += 1;
+    }
+}
+
+void Video::GPU::catch_up() {
+    finish_rendering();
+    U64 start_ns = Counters::now_ns();
+
+    // lines that would already have been rendered by now
+    U8 lines_due;
+    if(frame_waiting && render_thread_enabled){
+        // the frame's log was closed at vblank, and never got handed over
+        replay(render_job_log, render_job_count, ViewportHeight);
+        frame_waiting = False;
+        lines_due = 0;
+    } else if(frame_waiting){
+        lines_due = ViewportHeight;
+        frame_waiting = False;
+    } else {
+        switch(mode){
+            case OAM_READ_MODE:
+            case VRAM_READ_MODE:
+                lines_due = line;
+                break;
+            case HBLANK_MODE:
+                lines_due = line + 1;
+                break;
+            case VBLANK_MODE:
+                lines_due = 0; // the frame was finished when vblank started
+                break;
+            default:
+                assert(0); //unknown mode
+                lines_due = 0;
+                break;
+        }
+    }
+
+    replay(raster_logs[raster_log_idx], raster_log_count, lines_due);
+    raster_log_count = 0;
+    render_ns += Counters::now_ns() - start_ns;
+}
+
+void Video::GPU::set_render_thread(BOOL32 enabled) {
+    if(enabled == render_thread_enabled)
+        return;
+
+    if(enabled){
+        render_thread_quit = False;
+        render_thread = std::thread(&GPU::render_thread_main, this);
+        render_thread_enabled = True;
+    } else {
+        finish_rendering();
+        if(frame_waiting){
+            replay(render_job_log, render_job_count, ViewportHeight);
+            frame_waiting = False;
+        }
+        {
+            std::lock_guard<std::mutex> lock(render_mutex);
+            render_thread_quit = True;
+        }
+        render_cv.notify_all();
+        render_thread.join();
+        render_thread_enabled = False;
+    }
+}
+
+void Video::GPU::finish_rendering() {
+    if(!render_thread_enabled)
+        return;
+
+    std::unique_lock<std::mutex> lock(render_mutex);
+    if(render_job_pending){
+        U64 start_ns = Counters::now_ns();
+        while(render_job_pending){
+            render_cv.wait(lock);
+        }
+        render_ns += Counters::now_ns() - start_ns;
+    }
+}
+
+/*
+ Ends the finished frame's log as vblank starts, and starts logging into the other one, so
+ nothing the CPU writes after vblank can land in it. The render thread must be idle.
+ */
+void Video::GPU::close_frame() {
+    render_job_log = raster_logs[raster_log_idx];
+    render_job_count = raster_log_count;
+    raster_log_idx ^= 1;
+    raster_log_count = 0;
+}
+
+// hands the log closed by `close_frame` to the render thread
+void Video::GPU::submit_frame() {
+    std::lock_guard<std::mutex> lock(render_mutex);
+    assert(!render_job_pending);
+    frame_waiting = False;
+
+    render_job_pending = True;
+    render_cv.notify_all();
+}
+
+void Video::GPU::render_thread_main() {
+    std::unique_lock<std::mutex> lock(render_mutex);
+    while(true){
+        while(!render_job_pending && !render_thread_quit){
+            render_cv.wait(lock);
+        }
+        if(render_thread_quit)
+            return;
+
+        // the CPU thread doesn't touch any rendering state until the job is done
+        lock.unlock();
+        U64 start_ns = Counters::now_ns();
+        replay(render_job_log, render_job_count, ViewportHeight);
+        render_thread_ns.fetch_add(Counters::now_ns() - start_ns, std::memory_order_relaxed);
+        lock.lock();
+
+        render_job_pending = False;
+        render_cv.notify_all();
+    }
+}
+
+void Video::GPU::set_viewport_format(ViewportFormat format) {
+    if(format == viewport_format)
+        return;
+
+    viewport_format = format;
+    switch(format){
+        case ViewportFormat_Shades:
+            delete[] packed_viewport;
+            packed_viewport = NULL;
+            viewport = new Bitmap(ViewportWidth, ViewportHeight);
+            viewport->clear(0);
+            break;
+
+        case ViewportFormat_Packed2bpp:
+            delete viewport;
+            viewport = NULL;
+            packed_viewport = new U8[PackedViewportSize];
+            memset(packed_viewport, 0, PackedViewportSize);
+            break;
+    }
+}
+
+Bitmap* Video::GPU::tileset_view() {
+    finish_rendering();
+    if(!tileset){
+        tileset = new Bitmap(Tileset_PixelsPerRow, Tileset_PixelsPerColumn);
+    }
+    if(tileset_version != vram_version){
         update_tileset();
-        update_tilemap(&window, 0);
-        update_tilemap(&background, 1);
-        update_viewport();
+        tileset_version = vram_version;
+    }
+    return tileset;
+}
+
+Bitmap* Video::GPU::window_view() {
+    finish_rendering();
+    if(!window){
+        window = new Bitmap(ScreenBufferSize, ScreenBufferSize);
     }
+    if(window_version != vram_version){
+        update_tilemap(window, 0);
+        window_version = vram_version;
+    }
+    return window;
 }
 
-BOOL32 Video::GPU::step_mode(U8 cycles) {
-    BOOL32 redraw = False;
+Bitmap* Video::GPU::background_view() {
+    finish_rendering();
+    if(!background){
+        background = new Bitmap(ScreenBufferSize, ScreenBufferSize);
+    }
+    if(background_version != vram_version){
+        update_tilemap(background, 1);
+        background_version = vram_version;
+    }
+    return background;
+}
+
+U8 Video::GPU::stat() const {
+    U8 coincidence = (line == lyc ? Stat_Coincidence : 0);
+    return 0x80 | stat_select | coincidence | (U8)mode;
+}
+
+template<class Config>
+U8 Video::GPU::step(U8 cycles) {
+    if(Config::RenderThread && frame_waiting && render_thread_enabled){
+        submit_frame();
+    }
+
+    U8 interrupts = 0;
     cycles_elapsed += cycles;
 
     if(cycles_elapsed >= GPUModeDurations[mode]){
@@ -53,6 +759,8 @@ BOOL32 Video::GPU::step_mode(U8 cycles) {
 
             case VRAM_READ_MODE:
                 mode = HBLANK_MODE;
+                if(stat_select & StatSelect_HBlank)
+                    interrupts |= Interrupts::LCDStat;
                 break;
 
             case HBLANK_MODE:
@@ -60,12 +768,28 @@ BOOL32 Video::GPU::step_mode(U8 cycles) {
                 if(line == ViewportHeight){
                     // last line rendered, so enter vblank
                     mode = VBLANK_MODE;
-                    frame_number++;
-                    redraw = True;
+                    interrupts |= Interrupts::VBlank;
+                    if(stat_select & StatSelect_VBlank)
+                        interrupts |= Interrupts::LCDStat;
+
+                    frame_waiting = True;
+                    if(Config::RenderThread && render_thread_enabled){
+                        // the previous frame must be done. This one is handed over on the next
+                        // step, once the frontend has had a chance to swap `host_framebuffer`
+                        finish_rendering();
+                        close_frame();
+                    } else {
+                        catch_up();
+                    }
+                    frame_number = frames_rendered;
                 } else {
                     // move to next line
                     mode = OAM_READ_MODE;
+                    if(stat_select & StatSelect_OAM)
+                        interrupts |= Interrupts::LCDStat;
                 }
+                if((stat_select & StatSelect_Coincidence) && line == lyc)
+                    interrupts |= Interrupts::LCDStat;
                 break;
 
             case VBLANK_MODE:
@@ -75,81 +799,208 @@ BOOL32 Video::GPU::step_mode(U8 cycles) {
                     // start again
                     line = 0;
                     mode = OAM_READ_MODE;
+                    if(stat_select & StatSelect_OAM)
+                        interrupts |= Interrupts::LCDStat;
                 } else {
                     // mode stays the same
                 }
+                if((stat_select & StatSelect_Coincidence) && line == lyc)
+                    interrupts |= Interrupts::LCDStat;
                 break;
         }
     }
-    
-    return redraw;
+
+    return interrupts;
 }
 
+template U8 Video::GPU::step<DesktopConfig>(U8 cycles);
+template U8 Video::GPU::step<HeadlessConfig>(U8 cycles);
+
 void Video::GPU::update_tileset() {
     for(unsigned tile_idx = 0; tile_idx < VRAM::TileCount; ++tile_idx){
         U16 texture_x = (tile_idx % Tileset_TilesPerRow) * Tile::PixelSize;
         U16 texture_y = Tile::PixelSize * (tile_idx / Tileset_TilesPerRow);
-        blit_tile(&vram.tiles[tile_idx], &tileset, texture_x, texture_y);
+        blit_tile(tile_idx, tileset, texture_x, texture_y);
     }
 }
 
-void Video::GPU::blit_tile(Tile* tile, Bitmap* bitmap, U16 x, U16 y) {
+void Video::GPU::blit_tile(unsigned tile_idx, Bitmap* bitmap, U16 x, U16 y) {
     for(unsigned tile_row_idx = 0; tile_row_idx < Tile::PixelSize; ++tile_row_idx){
-        Video::Tile::Row& tile_row = tile->rows[tile_row_idx];
         U8* bitmap_row = bitmap->pixelPtr(x, y+tile_row_idx);
-        for(unsigned pixel_idx = 0; pixel_idx < Video::Tile::PixelSize; ++pixel_idx){
-            bitmap_row[pixel_idx] = tile_row.unpack_pixel(7 - pixel_idx);
-        }
+        memcpy(bitmap_row, tile_cache.row(tile_idx, tile_row_idx), Tile::PixelSize);
     }
 }
 
 void Video::GPU::update_tilemap(Bitmap* bitmap, U8 tilemap_idx) {
     for(unsigned y = 0; y < TileMap::TileSize; ++y){
         for(unsigned x = 0; x < TileMap::TileSize; ++x){
-            U8 tile_idx = vram.tilemaps[tilemap_idx].tiles[y][x];
+            U8 tile_idx = frame_vram.tilemaps[tilemap_idx].tiles[y][x];
             unsigned destx = x * Tile::PixelSize;
             unsigned desty = y * Tile::PixelSize;
-            blit_tile(&vram.tiles[tile_idx], bitmap, destx, desty);
+            blit_tile(tile_idx, bitmap, destx, desty);
         }
     }
 }
 
-void Video::GPU::update_viewport() {
-    //TODO: make sure all the LCDC flags are respected
+/*
+ Copies `width` pixels of one row of a tilemap into `dest`, starting at pixel
+ (map_x, map_y) of the 256x256 map and wrapping around horizontally.
+ */
+void Video::GPU::render_tilemap_line(U8* dest, unsigned tilemap_idx, BOOL32 signed_tiles, U8 map_x, U8 map_y, unsigned width) {
+    const U8* tilemap_row = frame_vram.tilemaps[tilemap_idx].tiles[map_y / Tile::PixelSize];
+    unsigned tile_row_idx = map_y % Tile::PixelSize;
+    unsigned tilemap_col = map_x / Tile::PixelSize;
+    unsigned skip = map_x % Tile::PixelSize; // only the first tile can be partially scrolled off
 
-    // clear the background
-//    BGRA clear_color = greyscale_to_bgra(0);
-//    SDL_SetRenderDrawColor(renderer, clear_color.r, clear_color.g, clear_color.b, clear_color.a);
-//    SDL_RenderFillRect(renderer, &dest);
-//
-//    if(!hw_regs->lcdc_display_enabled()){
-//        return;
-//    }
-//
-//    if(hw_regs->lcdc_background_enabled()){
-//        SDL_Rect bg_src = { hw_regs->scx, hw_regs->scy, Video::ViewportWidth, Video::ViewportHeight };
-//        SDL_RenderCopy(renderer, background, &bg_src, &dest);
-//    }
-//
-//    if(hw_regs->lcdc_window_enabled()){
-//        const int WX_OFFSET = 7;
-//        int wx = hw_regs->wx;
-//        int wy = hw_regs->wy;
-//        if(wx <= Video::ViewportWidth + WX_OFFSET - 1 && wy <= Video::ViewportHeight - 1){
-//            SDL_Rect window_src = {
-//                wx < WX_OFFSET ? WX_OFFSET - wx : 0,
-//                0,
-//                Video::ViewportWidth - (wx < WX_OFFSET ? 0 : wx - WX_OFFSET),
-//                Video::ViewportHeight - wy,
-//            };
-//            SDL_Rect window_dest = {
-//                dest.x + 2*(wx < WX_OFFSET ? 0 : wx - WX_OFFSET),
-//                dest.y + 2*wy,
-//                2*window_src.w,
-//                2*window_src.h,
-//            };
-//            SDL_RenderCopy(renderer, window, &window_src, &window_dest);
-//        }
-//    }
+    while(width > 0){
+        unsigned tile_idx = tilemap_tile_index(tilemap_row[tilemap_col], signed_tiles);
+        unsigned count = Tile::PixelSize - skip;
+        if(count > width)
+            count = width;
+
+        memcpy(dest, tile_cache.row(tile_idx, tile_row_idx) + skip, count);
+
+        dest += count;
+        width -= count;
+        skip = 0;
+        tilemap_col = (tilemap_col + 1) % TileMap::TileSize;
+    }
+}
+
+// maps each color number to the shade with the same number
+static const U8 IdentityPalette = 0xE4;
+
+static inline U8 palette_shade(U8 palette_register, U8 color) {
+    return (palette_register >> (color * 2)) & 0x03;
 }
 
+void Video::GPU::render_line(U8 line_idx) {
+    HardwareRegisters::Registers* hwr = &frame_registers;
+    if(line_idx == 0){
+        window_line = 0;
+    }
+
+    // color numbers for the line, before the palette is applied
+    U8 colors[ViewportWidth];
+
+    if(!hwr->lcdc_display_enabled()){
+        memset(colors, 0, ViewportWidth);
+        output_line(line_idx, colors, 0);
+        return;
+    }
+
+    BOOL32 signed_tiles = hwr->lcdc_tile_indexes_are_signed();
+
+    if(hwr->lcdc_background_enabled()){
+        render_tilemap_line(colors,
+                            hwr->lcdc_background_tilemap_index(),
+                            signed_tiles,
+                            hwr->scx,
+                            hwr->scy + line_idx,
+                            ViewportWidth);
+    } else {
+        memset(colors, 0, ViewportWidth);
+    }
+
+    const U8 WXOffset = 7;
+    if(hwr->lcdc_window_enabled() && hwr->wy <= line_idx && hwr->wx < ViewportWidth + WXOffset){
+        unsigned window_x = (hwr->wx < WXOffset ? 0 : hwr->wx - WXOffset);
+        U8 skip = (hwr->wx < WXOffset ? WXOffset - hwr->wx : 0);
+        render_tilemap_line(colors + window_x,
+                            hwr->lcdc_window_tilemap_index(),
+                            signed_tiles,
+                            skip,
+                            window_line,
+                            ViewportWidth - window_x);
+        window_line += 1;
+    }
+
+    unsigned sprite_count = 0;
+    const U8* sprite_idxs = NULL;
+    if(hwr->lcdc_sprites_enabled()){
+        sprite_idxs = sprite_index.line(&frame_oam, line_idx, &sprite_count);
+    }
+
+    if(sprite_count == 0){
+        // the palette can be folded into the output
+        output_line(line_idx, colors, hwr->bgp);
+    } else {
+        U8 shades[ViewportWidth];
+        for(unsigned x = 0; x < ViewportWidth; ++x){
+            shades[x] = palette_shade(hwr->bgp, colors[x]);
+        }
+        render_sprites_line(line_idx, sprite_idxs, sprite_count, colors, shades);
+        output_line(line_idx, shades, IdentityPalette);
+    }
+}
+
+/*
+ Draws the sprites for a line over the background/window `shades`. `bg_colors` are the
+ color numbers before the palette was applied, which decide whether a sprite behind the
+ background shows through.
+ */
+void Video::GPU::render_sprites_line(U8 line_idx, const U8* sprite_idxs, unsigned sprite_count, const U8* bg_colors, U8* shades) {
+    // once the highest priority sprite has an opaque pixel somewhere, nothing else gets drawn there
+    U8 taken[ViewportWidth];
+    memset(taken, 0, sizeof(taken));
+
+    for(unsigned i = 0; i < sprite_count; ++i){
+        const Sprite* sprite = &frame_oam.sprites[sprite_idxs[i]];
+        U8 palette_register = (sprite->flags & Sprite::SpriteFlag_Palette) ? frame_registers.obp1 : frame_registers.obp0;
+        BOOL32 behind_bg = (sprite->flags & Sprite::SpriteFlag_Priority) != 0;
+        TileFlip flip = (TileFlip)((sprite->flags >> 5) & 0x03);
+
+        unsigned sprite_row = line_idx + SpriteYOffset - sprite->y;
+        unsigned tile_idx = sprite->pattern;
+        if(sprite_index.sprite_height == 16){
+            tile_idx &= 0xFE;
+            // in 8x16 mode, y flipping also swaps the two tiles
+            unsigned flipped_row = (flip & TileFlip_Y) ? (15 - sprite_row) : sprite_row;
+            tile_idx += flipped_row / Tile::PixelSize;
+        }
+        const U8* pixels = tile_cache.row(tile_idx, sprite_row % Tile::PixelSize, flip);
+
+        for(unsigned px = 0; px < Tile::PixelSize; ++px){
+            int x = (int)sprite->x - SpriteXOffset + px;
+            if(x < 0 || x >= ViewportWidth || taken[x] || pixels[px] == 0)
+                continue;
+            taken[x] = 1;
+            if(!behind_bg || bg_colors[x] == 0){
+                shades[x] = palette_shade(palette_register, pixels[px]);
+            }
+        }
+    }
+}
+
+/*
+ Writes one line of color numbers to wherever the viewport is going, applying the
+ palette on the way.
+ */
+void Video::GPU::output_line(U8 line_idx, const U8* colors, U8 palette_register) {
+    // color number -> shade
+    U8 shades[4];
+    for(unsigned color = 0; color < 4; ++color){
+        shades[color] = palette_shade(palette_register, color);
+    }
+
+    if(host_framebuffer){
+        // fold the palette into the host colors, so the line is converted in one pass
+        U32 host_palette[4];
+        for(unsigned color = 0; color < 4; ++color){
+            host_palette[color] = host_framebuffer->palette[shades[color]];
+        }
+        U8* dest = (U8*)host_framebuffer->pixels + line_idx * host_framebuffer->pitch;
+        convert_shades_to_host(colors, ViewportWidth, host_palette, host_framebuffer->format, dest);
+    } else if(viewport_format == ViewportFormat_Packed2bpp){
+        U8 line_shades[ViewportWidth];
+        for(unsigned x = 0; x < ViewportWidth; ++x){
+            line_shades[x] = shades[colors[x]];
+        }
+        pack_2bpp(line_shades, ViewportWidth, packed_viewport + line_idx * PackedViewportRowSize);
+    } else {
+        U8* dest = viewport->pixelPtr(0, line_idx);
+        for(unsigned x = 0; x < ViewportWidth; ++x){
+            dest[x] = shades[colors[x]];
+        }
+    }
+}
@@ -1,7 +1,14 @@
 # pragma once
 
 #include "types.hpp"
+#include "config.hpp"
 #include "bitmap.hpp"
+#include "hardware_registers.hpp"
+#include "interrupts.hpp"
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 namespace Video {
     /*
@@ -38,6 +45,9 @@ namespace Video {
      
      Both background and window can be disabled or enabled separately via bits in the LCDC register.
      */
+    const U16 VRAMAddress = 0x8000; // up to 0x9FFF
+    const U16 OAMAddress = 0xFE00; // up to 0xFE9F
+
     const U16 TileMap1Address = 0x9800; // up to 0x9BFF
     const U16 TileMap2Address = 0x9C00; // up to 0x9FFF
 
@@ -103,6 +113,51 @@ namespace Video {
         };
     };
 
+    /*
+     Converts `row_count` rows of 2bpp tile data into 8 color numbers (0-3) per row, written
+     contiguously to `out`. Uses SSE2 where available, with a portable fallback.
+     */
+    void decode_tile_rows(const Tile::Row* rows, unsigned row_count, U8* out);
+    void decode_tile_rows_portable(const Tile::Row* rows, unsigned row_count, U8* out); // never uses SSE2, for comparison
+
+    /*
+     The orientations a tile can be drawn in. Sprites select one of these with their
+     SpriteFlag_XFlip and SpriteFlag_YFlip bits, which conveniently map to
+     `(flags >> 5) & 0x03`. The background and window only ever use TileFlip_None.
+     */
+    enum TileFlip {
+        TileFlip_None = 0,
+        TileFlip_X = 1,
+        TileFlip_Y = 2,
+        TileFlip_XY = 3,
+        TileFlipCount = 4,
+    };
+
+    /*
+     A tile unpacked from the 2bpp VRAM format into one color number (0-3) per byte,
+     so that whole rows can be copied straight into a bitmap.
+     */
+    struct DecodedTile {
+        U8 pixels[Tile::PixelSize][Tile::PixelSize];
+    };
+
+    /*
+     Every tile in VRAM, pre-decoded in all four orientations.
+
+     This is kept up to date incrementally: each write into the tile data area
+     (0x8000 - 0x97FF) re-decodes the single row that the written byte belongs to.
+     */
+    struct TileCache {
+        DecodedTile tiles[TileFlipCount][VRAM::TileCount];
+
+        void decode_all(const VRAM* vram);
+        void decode_row(const VRAM* vram, U16 vram_offset);
+
+        const U8* row(unsigned tile_idx, unsigned row_idx, TileFlip flip = TileFlip_None) const {
+            return tiles[flip][tile_idx].pixels[row_idx];
+        }
+    };
+
     const unsigned Tileset_TilesPerRow = 16;
     const unsigned Tileset_TilesPerColumn = (VRAM::TileCount / Tileset_TilesPerRow);
     const unsigned Tileset_PixelsPerRow = Tileset_TilesPerRow * Tile::PixelSize;
@@ -133,30 +188,229 @@ namespace Video {
     };
 
     union OAM {
+        static const unsigned SpriteCount = 40;
+
         U8 memory[160];
-        Video::Sprite sprites[40];
+        Video::Sprite sprites[SpriteCount];
     };
 
+    /*
+     Sprite positions are offset from the screen, so that they can be partially off the
+     top and left edges. A sprite at (0, 0) is completely hidden.
+     */
+    const U8 SpriteXOffset = 8;
+    const U8 SpriteYOffset = 16;
+
+    /*
+     Only 10 sprites can be displayed on any one line. These are the first 10 in OAM that
+     cover the line, whether or not they are horizontally on screen. When sprites overlap,
+     the one with the smaller X coordinate wins, and then the one that comes first in OAM.
+
+     Rather than checking all 40 sprites on every line, this keeps a mask of the sprites
+     covering each line, updated as OAM is written. The ordered list for a line is only
+     rebuilt when a sprite on that line has moved.
+     */
+    struct SpriteIndex {
+        static const unsigned MaxSpritesPerLine = 10;
+
+        U64 line_masks[ViewportHeight]; // bit n is set if sprite n covers the line
+        U8 lines[ViewportHeight][MaxSpritesPerLine]; // sprite indexes, highest priority first
+        U8 line_counts[ViewportHeight];
+        BOOL32 line_stale[ViewportHeight];
+        U8 sprite_height; // 8 or 16
+
+        void rebuild(const OAM* oam, U8 height);
+        void sprite_written(const OAM* oam, U8 sprite_idx, U8 old_y, U8 old_x);
+        const U8* line(const OAM* oam, U8 line_idx, unsigned* out_count);
+
+    private:
+        void set_coverage(U8 sprite_idx, U8 y, BOOL32 covered);
+        void mark_stale(U8 y);
+    };
+
+    /*
+     Pixel formats that the viewport can be rendered into directly, for frontends that
+     want to hand the result straight to the graphics API.
+     */
+    enum HostPixelFormat {
+        HostPixelFormat_ARGB8888, // one U32 per pixel
+        HostPixelFormat_RGB565,   // one U16 per pixel
+    };
+
+    U32 host_color(U8 r, U8 g, U8 b, HostPixelFormat format);
+
+    /*
+     Converts `count` shades (0-3) into host pixels using a 4-entry palette of colors that
+     are already in `format` (see `host_color`). Uses SSE2 where available.
+     */
+    void convert_shades_to_host(const U8* shades, unsigned count, const U32 palette[4], HostPixelFormat format, void* out);
+
+    /*
+     Memory owned by the frontend (e.g. a locked SDL_Texture) that the GPU renders each
+     viewport line into, instead of its own viewport.
+     */
+    struct HostFramebuffer {
+        void* pixels;
+        int pitch; // in bytes, between the start of each row
+        HostPixelFormat format;
+        U32 palette[4]; // host color for each shade
+    };
+
+    /*
+     How the GPU stores the finished viewport when there is no `HostFramebuffer`.
+
+     Each pixel is only ever one of 4 shades, so the packed format stores 4 pixels per byte,
+     leftmost pixel in the top two bits (the same order as tile data). That is 5760 bytes
+     per frame instead of 23040, for frontends that move lots of frames around.
+     */
+    enum ViewportFormat {
+        ViewportFormat_Shades,     // `viewport` bitmap, one shade per byte
+        ViewportFormat_Packed2bpp, // `packed_viewport`, four shades per byte
+    };
+
+    const unsigned PackedViewportRowSize = ViewportWidth / 4;
+    const unsigned PackedViewportSize = PackedViewportRowSize * ViewportHeight;
+
+    /*
+     Converts between one shade (0-3) per byte and 4 shades per byte, as described for
+     ViewportFormat_Packed2bpp. `pixel_count` must be a multiple of 4. Use SSE2 where available.
+     */
+    void pack_2bpp(const U8* shades, unsigned pixel_count, U8* out_packed);
+    void unpack_2bpp(const U8* packed, unsigned pixel_count, U8* out_shades);
+
+    /*
+     A write to VRAM, OAM or one of the registers that affect rendering, stamped with the
+     position of the beam when it happened.
+     */
+    struct RasterWrite {
+        U8 line;
+        U16 dot; // cycles since the start of the line
+        U16 address;
+        U8 value;
+    };
+
+    // the log is replayed early if it fills up before vblank
+    const unsigned RasterLogCapacity = 4096;
+
+    /*
+     The GPU doesn't render lines while the CPU is running. Instead, every write that could
+     change the picture is appended to `raster_log`, and at vblank the whole frame is rendered
+     in one go by replaying the log against the frame's own copy of VRAM, OAM and registers.
+
+     A write is visible to a line if it happened before that line's pixel transfer finished
+     (the end of VRAM_READ_MODE), which is exactly when lines used to be rendered, so scroll
+     and palette changes made mid-frame still land on the right lines. Writes made during
+     vblank are visible from line 0 of the next frame.
+
+     With `set_render_thread(True)`, the replay for frame N runs on a worker thread while
+     the CPU emulates frame N+1, so `frame_number` (and the pixels) lag one frame behind.
+     */
     struct GPU {
-        VRAM vram;
+        // checked on every step, so these come first
         U8 line;
+        U8 lyc;
+        U8 stat_select; // the interrupt selection bits of STAT
         GPUMode mode;
         U32 cycles_elapsed;
-        U32 frame_number;
+        U32 frame_number; // frames whose pixels are finished
+        BOOL32 frame_waiting; // vblank has started, but the frame hasn't been rendered or handed over
+        BOOL32 render_thread_enabled;
+
+        VRAM vram; // what the CPU sees
+
+        /*
+         Rendering state, as of the last line that was rendered. Only changed by replaying
+         `raster_log`.
+         */
+        VRAM frame_vram;
+        TileCache tile_cache; // decoded from `frame_vram`
+        OAM frame_oam;
+        SpriteIndex sprite_index; // of `frame_oam`
+        HardwareRegisters::Registers frame_registers; // only LCDC, SCX/Y, WX/Y and the palettes
+        U8 window_line; // internal line counter, only advances on lines where the window is drawn
+        U8 next_render_line;
+        U32 frames_rendered;
+
+        // the CPU logs into one while the render thread replays the other
+        RasterWrite raster_logs[2][RasterLogCapacity];
+        unsigned raster_log_idx;
+        unsigned raster_log_count;
+
+        /*
+         The finished frame. Only one of these exists at a time, depending on
+         `viewport_format` (see `set_viewport_format`).
+         */
+        ViewportFormat viewport_format;
+        Bitmap* viewport;
+        U8* packed_viewport; // PackedViewportSize bytes
 
-        Bitmap viewport;
-        Bitmap tileset;
-        Bitmap window;
-        Bitmap background;
+        /*
+         Debug views of VRAM. These are only allocated and rendered when asked for, through
+         `tileset_view()` etc., and are then cached until VRAM changes.
+         */
+        Bitmap* tileset;
+        Bitmap* window;
+        Bitmap* background;
+        U32 vram_version; // incremented whenever the rendered VRAM changes
+        U32 tileset_version;
+        U32 window_version;
+        U32 background_version;
+
+        /*
+         When set, finished lines are written here instead of into the viewport. Every line is
+         rewritten each frame, so the frontend only needs to keep the memory valid until
+         `frame_number` changes. It may only be changed straight after `frame_number` changes,
+         before the next `step`, which is when the render thread is guaranteed to be idle.
+         */
+        HostFramebuffer* host_framebuffer;
+
+        std::thread render_thread;
+        std::mutex render_mutex;
+        std::condition_variable render_cv;
+        BOOL32 render_job_pending;
+        BOOL32 render_thread_quit;
+        const RasterWrite* render_job_log;
+        unsigned render_job_count;
+
+        // host time spent rendering, for `emulator_counters`
+        U64 render_ns; // on the CPU thread, including waiting for the render thread
+        std::atomic<U64> render_thread_ns; // written by the render thread
 
         GPU();
-        void step(U8 cycles);
+        ~GPU();
+        template<class Config> U8 step(U8 cycles); // returns interrupts to request
+        U8 stat() const;
+        void write_vram(U16 vram_offset, U8 value);
+        void write_oam(U16 oam_offset, U8 value);
+        void write_register(U16 address, U8 value);
+        void reset_vram();
+
+        // renders any lines that are due and applies the rest of the log
+        void catch_up();
+
+        // waits for the render thread to go idle, if there is one
+        void finish_rendering();
+        void set_viewport_format(ViewportFormat format);
+        void set_render_thread(BOOL32 enabled);
+
+        Bitmap* tileset_view();
+        Bitmap* window_view();
+        Bitmap* background_view();
 
     private:
-        BOOL32 step_mode(U8 cycles);
         void update_tileset();
-        void blit_tile(Tile* tile, Bitmap* bitmap, U16 x, U16 y);
+        void blit_tile(unsigned tile_idx, Bitmap* bitmap, U16 x, U16 y);
         void update_tilemap(Bitmap* bitmap, U8 tilemap_idx);
-        void update_viewport();
+        U16 current_dot() const;
+        void log_write(U16 address, U8 value);
+        void apply_write(const RasterWrite* write);
+        void replay(const RasterWrite* log, unsigned count, U8 lines_due);
+        void close_frame();
+        void submit_frame();
+        void render_thread_main();
+        void render_line(U8 line_idx);
+        void render_sprites_line(U8 line_idx, const U8* sprite_idxs, unsigned sprite_count, const U8* bg_colors, U8* shades);
+        void output_line(U8 line_idx, const U8* colors, U8 palette_register);
+        void render_tilemap_line(U8* dest, unsigned tilemap_idx, BOOL32 signed_tiles, U8 map_x, U8 map_y, unsigned width);
     };
 } //namespace Video